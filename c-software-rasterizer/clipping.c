@@ -1,74 +1,49 @@
-#include <math.h>
 #include "clipping.h"
+#include "stats.h"
 
-#define NUM_PLANES 6
+bool is_guard_band = true;
 
-plane_t frustum_planes[NUM_PLANES];
+void set_guard_band(bool is_enabled) {
+	is_guard_band = is_enabled;
+}
+
+bool is_guard_band_enabled(void) {
+	return is_guard_band;
+}
 
 ///////////////////////////////////////////////////////////////////////////////
-// Frustum planes are defined by a point and a normal vector
-///////////////////////////////////////////////////////////////////////////////
-// Near plane   :  P = (0, 0, znear), N = (0, 0,  1)
-// Far plane    :  P = (0, 0, zfar),  N = (0, 0, -1)
-// Top plane    :  P = (0, 0, 0),     N = (0, -cos(fov/2), sin(fov/2))
-// Bottom plane :  P = (0, 0, 0),     N = (0, cos(fov/2), sin(fov/2))
-// Left plane   :  P = (0, 0, 0),     N = (cos(fov/2), 0, sin(fov/2))
-// Right plane  :  P = (0, 0, 0),     N = (-cos(fov/2), 0, sin(fov/2))
+// Frustum planes in homogeneous clip space
 ///////////////////////////////////////////////////////////////////////////////
+// After the projection matrix the view volume is the same for every fov and
+// aspect ratio, and the signed distance of a vertex to each plane is a plain
+// sum or difference of its coordinates (positive inside):
 //
-//              /|\
-//            /  | | 
-//          /\   | |
-//        /      | |
-//     P*|-->  <-|*|   ----> +z-axis
-//        \      | |
-//          \/   | |
-//            \  | | 
-//              \|/
+// Left plane   :  w + x
+// Right plane  :  w - x
+// Top plane    :  w - y
+// Bottom plane :  w + y
+// Near plane   :  z
+// Far plane    :  w - z
 //
+// The guard band side planes are the same with w scaled by GUARD_BAND_SCALE.
 ///////////////////////////////////////////////////////////////////////////////
-void init_frustum_planes(float fov_x, float fov_y, float z_near, float z_far) {
-	float cos_half_fov_x = cos(fov_x / 2);
-	float sin_half_fov_x = sin(fov_x / 2);
-	float cos_half_fov_y = cos(fov_y / 2);
-	float sin_half_fov_y = sin(fov_y / 2);
-
-	frustum_planes[LEFT_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
-	frustum_planes[LEFT_FRUSTUM_PLANE].normal.x = cos_half_fov_x;
-	frustum_planes[LEFT_FRUSTUM_PLANE].normal.y = 0;
-	frustum_planes[LEFT_FRUSTUM_PLANE].normal.z = sin_half_fov_x;
-
-	frustum_planes[RIGHT_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
-	frustum_planes[RIGHT_FRUSTUM_PLANE].normal.x = -cos_half_fov_x;
-	frustum_planes[RIGHT_FRUSTUM_PLANE].normal.y = 0;
-	frustum_planes[RIGHT_FRUSTUM_PLANE].normal.z = sin_half_fov_x;
-
-	frustum_planes[TOP_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
-	frustum_planes[TOP_FRUSTUM_PLANE].normal.x = 0;
-	frustum_planes[TOP_FRUSTUM_PLANE].normal.y = -cos_half_fov_y;
-	frustum_planes[TOP_FRUSTUM_PLANE].normal.z = sin_half_fov_y;
-
-	frustum_planes[BOTTOM_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
-	frustum_planes[BOTTOM_FRUSTUM_PLANE].normal.x = 0;
-	frustum_planes[BOTTOM_FRUSTUM_PLANE].normal.y = cos_half_fov_y;
-	frustum_planes[BOTTOM_FRUSTUM_PLANE].normal.z = sin_half_fov_y;
-
-	frustum_planes[NEAR_FRUSTUM_PLANE].point = vec3_new(0, 0, z_near);
-	frustum_planes[NEAR_FRUSTUM_PLANE].normal.x = 0;
-	frustum_planes[NEAR_FRUSTUM_PLANE].normal.y = 0;
-	frustum_planes[NEAR_FRUSTUM_PLANE].normal.z = 1;
-
-	frustum_planes[FAR_FRUSTUM_PLANE].point = vec3_new(0, 0, z_far);
-	frustum_planes[FAR_FRUSTUM_PLANE].normal.x = 0;
-	frustum_planes[FAR_FRUSTUM_PLANE].normal.y = 0;
-	frustum_planes[FAR_FRUSTUM_PLANE].normal.z = -1;
+static float plane_distance(vec4_t v, int plane, float w_scale) {
+	switch (plane) {
+		case LEFT_FRUSTUM_PLANE:	return v.w * w_scale + v.x;
+		case RIGHT_FRUSTUM_PLANE:	return v.w * w_scale - v.x;
+		case TOP_FRUSTUM_PLANE:		return v.w * w_scale - v.y;
+		case BOTTOM_FRUSTUM_PLANE:	return v.w * w_scale + v.y;
+		case NEAR_FRUSTUM_PLANE:	return v.z;
+		default:					return v.w - v.z;
+	}
 }
 
-polygon_t create_polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2, tex2_t t0, tex2_t t1, tex2_t t2) {
+polygon_t create_polygon_from_triangle(vec4_t v0, vec4_t v1, vec4_t v2, tex2_t t0, tex2_t t1, tex2_t t2) {
 	polygon_t polygon = {
 		.vertices = { v0, v1, v2 },
-		.texcoords = { t0, t1, t2 },
-		.num_vertices = 3
+		.attributes = { { t0.u, t0.v }, { t1.u, t1.v }, { t2.u, t2.v } },
+		.num_vertices = 3,
+		.num_attributes = 2
 	};
 	return polygon;
 }
@@ -79,13 +54,13 @@ void triangles_from_polygon(polygon_t* polygon, triangle_t triangles[], int* num
 		int index1 = i + 1;
 		int index2 = i + 2;
 
-		triangles[i].points[0] = vec4_from_vec3(polygon->vertices[index0]);
-		triangles[i].points[1] = vec4_from_vec3(polygon->vertices[index1]);
-		triangles[i].points[2] = vec4_from_vec3(polygon->vertices[index2]);
+		triangles[i].points[0] = polygon->vertices[index0];
+		triangles[i].points[1] = polygon->vertices[index1];
+		triangles[i].points[2] = polygon->vertices[index2];
 
-		triangles[i].texcoords[0] = polygon->texcoords[index0];
-		triangles[i].texcoords[1] = polygon->texcoords[index1];
-		triangles[i].texcoords[2] = polygon->texcoords[index2];
+		triangles[i].texcoords[0] = (tex2_t){ polygon->attributes[index0][0], polygon->attributes[index0][1] };
+		triangles[i].texcoords[1] = (tex2_t){ polygon->attributes[index1][0], polygon->attributes[index1][1] };
+		triangles[i].texcoords[2] = (tex2_t){ polygon->attributes[index2][0], polygon->attributes[index2][1] };
 	}
 	*num_triangles = polygon->num_vertices - 2;
 }
@@ -95,92 +70,246 @@ float float_lerp(float a, float b, float t) {
 	return a + t * (b - a);
 }
 
-void clip_polygon_against_plane(polygon_t* polygon, int plane) {
-	// Establish the point and normal of the specified plane
-	vec3_t plane_point = frustum_planes[plane].point;
-	vec3_t plane_normal = frustum_planes[plane].normal;
-
-	// Declare the array of inside vertices that will make up the final polygon to be returned via parameter
-	vec3_t inside_vertices[MAX_NUM_POLY_VERTICES];
-	tex2_t inside_texcoords[MAX_NUM_POLY_VERTICES];
-	int num_inside_vertices = 0;
-
-	// Start current vertex with the first polygon vertex and texture coordinate
-	vec3_t* current_vertex = &polygon->vertices[0];
-	tex2_t* current_texcoord = &polygon->texcoords[0];
-
-	// Start previous vertex with the last polygon vertex and texture coordinate
-	vec3_t* previous_vertex = &polygon->vertices[polygon->num_vertices - 1];
-	tex2_t* previous_texcoord = &polygon->texcoords[polygon->num_vertices - 1];
+// Clips the source polygon against one plane into the destination polygon, so consecutive planes can ping-pong between two polygons
+static void clip_polygon_against_plane(const polygon_t* source, polygon_t* destination, int plane) {
+	int num_attributes = source->num_attributes;
+	destination->num_attributes = num_attributes;
+	destination->num_vertices = 0;
 
-	// Calculate the dot product of the current and previous vertices
-	float current_dot = 0;
-	float previous_dot = vec3_dot(vec3_sub(*previous_vertex, plane_point), plane_normal);
+	// Nothing is left to clip once an earlier plane removed the whole polygon
+	if (source->num_vertices == 0) {
+		return;
+	}
 
-	// Loop while the current vertex is different than the last vertex
-	while (current_vertex != &polygon->vertices[polygon->num_vertices]) {
+	// Start previous vertex with the last polygon vertex
+	int previous = source->num_vertices - 1;
+	float previous_distance = plane_distance(source->vertices[previous], plane, 1.0f);
 
-		current_dot = vec3_dot(vec3_sub(*current_vertex, plane_point), plane_normal);
+	for (int current = 0; current < source->num_vertices; current++) {
+		float current_distance = plane_distance(source->vertices[current], plane, 1.0f);
 
 		// If we changed from inside to outside or vice-versa
-		if (current_dot * previous_dot < 0) {
-			// Calculate interpolation factor t = dotQp / (dotQp - dotQc), where Q = vertex, p = previous, c = current
-			float t = previous_dot / (previous_dot - current_dot);
-			// Calculate intersection point I = Qp + t(Qc - Qp) //////////////////////////////////////////////////////
-			vec3_t intersection_point = {
-				.x = float_lerp(previous_vertex->x, current_vertex->x, t),
-				.y = float_lerp(previous_vertex->y, current_vertex->y, t),
-				.z = float_lerp(previous_vertex->z, current_vertex->z, t)
-			};
+		if (current_distance * previous_distance < 0) {
+			// Calculate interpolation factor t = dQp / (dQp - dQc), where Q = vertex, p = previous, c = current
+			float t = previous_distance / (previous_distance - current_distance);
 
-			// Replaced by lerp calculations above //\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//
-			// vec3_t intersection_point = vec3_clone(current_vertex);						// I = Qc
-			// intersection_point = vec3_sub(intersection_point, *previous_vertex);			// I = (Qc - Qp)
-			// intersection_point = vec3_mul(intersection_point, t);						// I = t(Qc - Qp)
-			// intersection_point = vec3_add(intersection_point, *previous_vertex);			// I = Qp + t(Q2 - Q1)
-			//////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-			// Use lerp to get the interpolated u and v texture coordinates
-			tex2_t interpolated_texcoord = {
-				.u = float_lerp(previous_texcoord->u, current_texcoord->u, t),
-				.v = float_lerp(previous_texcoord->v, current_texcoord->v, t)
+			// Position and attributes are linear in clip space, so the intersection interpolates them all with the same t
+			const vec4_t* p = &source->vertices[previous];
+			const vec4_t* c = &source->vertices[current];
+			int index = destination->num_vertices++;
+			destination->vertices[index] = (vec4_t){
+				.x = float_lerp(p->x, c->x, t),
+				.y = float_lerp(p->y, c->y, t),
+				.z = float_lerp(p->z, c->z, t),
+				.w = float_lerp(p->w, c->w, t)
 			};
-
-			// Insert the new intersection point in the list of "inside vertices"
-			inside_vertices[num_inside_vertices] = vec3_clone(&intersection_point);
-			inside_texcoords[num_inside_vertices] = tex2_clone(&interpolated_texcoord);
-			num_inside_vertices++;
+			for (int a = 0; a < num_attributes; a++) {
+				destination->attributes[index][a] = float_lerp(source->attributes[previous][a], source->attributes[current][a], t);
+			}
 		}
 
-		// If the current point is inside the plane
-		if (current_dot > 0) {
-			// Insert the current vertex in the list of "inside vertices"
-			inside_vertices[num_inside_vertices] = vec3_clone(current_vertex);
-			inside_texcoords[num_inside_vertices] = tex2_clone(current_texcoord);
-			num_inside_vertices++;
+		// If the current point is inside the plane (a point on the plane is its own intersection and is kept too)
+		if (current_distance >= 0) {
+			int index = destination->num_vertices++;
+			destination->vertices[index] = source->vertices[current];
+			for (int a = 0; a < num_attributes; a++) {
+				destination->attributes[index][a] = source->attributes[current][a];
+			}
 		}
 
 		// Move to the next vertex
-		previous_dot = current_dot;
-		previous_vertex = current_vertex;
-		previous_texcoord = current_texcoord;
-		current_vertex++;
-		current_texcoord++;
+		previous_distance = current_distance;
+		previous = current;
+	}
+}
+
+// Returns true when no vertex of the polygon is outside the guard band side plane
+static bool is_polygon_inside_guard_band(polygon_t* polygon, int plane) {
+	for (int i = 0; i < polygon->num_vertices; i++) {
+		if (plane_distance(polygon->vertices[i], plane, GUARD_BAND_SCALE) < 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Outcodes
+///////////////////////////////////////////////////////////////////////////////
+// Each vertex gets one bit per frustum plane it is outside of, followed by one
+// bit per guard band side plane. A triangle whose vertices share a frustum
+// bit is entirely outside that plane, and a triangle whose vertices have no
+// bit that needs a real clip goes straight to projection. Clipping a triangle
+// against a plane keeps it inside its own convex hull, so only the planes in
+// the union of the outcodes can cut the polygon at all.
+///////////////////////////////////////////////////////////////////////////////
+int compute_outcode(vec4_t point) {
+	float guard_w = point.w * GUARD_BAND_SCALE;
+	int outcode = 0;
+	if (point.x < -point.w) outcode |= FRUSTUM_OUTCODE(LEFT_FRUSTUM_PLANE);
+	if (point.x > point.w) outcode |= FRUSTUM_OUTCODE(RIGHT_FRUSTUM_PLANE);
+	if (point.y > point.w) outcode |= FRUSTUM_OUTCODE(TOP_FRUSTUM_PLANE);
+	if (point.y < -point.w) outcode |= FRUSTUM_OUTCODE(BOTTOM_FRUSTUM_PLANE);
+	if (point.z < 0) outcode |= FRUSTUM_OUTCODE(NEAR_FRUSTUM_PLANE);
+	if (point.z > point.w) outcode |= FRUSTUM_OUTCODE(FAR_FRUSTUM_PLANE);
+	if (point.x < -guard_w) outcode |= GUARD_BAND_OUTCODE(LEFT_FRUSTUM_PLANE);
+	if (point.x > guard_w) outcode |= GUARD_BAND_OUTCODE(RIGHT_FRUSTUM_PLANE);
+	if (point.y > guard_w) outcode |= GUARD_BAND_OUTCODE(TOP_FRUSTUM_PLANE);
+	if (point.y < -guard_w) outcode |= GUARD_BAND_OUTCODE(BOTTOM_FRUSTUM_PLANE);
+	return outcode;
+}
+
+// Classifies a primitive from the intersection and the union of the outcodes of its vertices
+static int classify_outcodes(int and_outcode, int or_outcode) {
+	if ((and_outcode & FRUSTUM_OUTCODE_MASK) != 0) {
+		return CLIP_TRIVIAL_REJECT;
+	}
+
+	// With the guard band the side planes only need a real clip where the triangle leaves the band
+	int clip_mask = is_guard_band
+		? FRUSTUM_OUTCODE(NEAR_FRUSTUM_PLANE) | FRUSTUM_OUTCODE(FAR_FRUSTUM_PLANE) | GUARD_BAND_OUTCODE_MASK
+		: FRUSTUM_OUTCODE_MASK;
+	if ((or_outcode & clip_mask) == 0) {
+		return CLIP_TRIVIAL_ACCEPT;
+	}
+	return CLIP_NEEDED;
+}
+
+int classify_triangle(int outcode0, int outcode1, int outcode2) {
+	return classify_outcodes(outcode0 & outcode1 & outcode2, outcode0 | outcode1 | outcode2);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Bounding volumes
+///////////////////////////////////////////////////////////////////////////////
+// A whole mesh is classified before any of its vertices is transformed. The
+// plane distances are linear in the clip space position, so applying them to
+// the columns of the world-view-projection matrix gives every plane in model
+// space, where the bounding sphere costs one dot product per plane. A sphere
+// that straddles a plane falls back to the outcodes of the eight transformed
+// corners of the bounding box, which is tighter: the box is convex, so it is
+// outside a plane when all its corners are and inside when all its corners
+// are.
+///////////////////////////////////////////////////////////////////////////////
+static float sphere_plane_distance(mat4_t m, vec3_t center, int plane, float w_scale) {
+	float coefficients[4];
+	for (int j = 0; j < 4; j++) {
+		vec4_t column = { m.m[0][j], m.m[1][j], m.m[2][j], m.m[3][j] };
+		coefficients[j] = plane_distance(column, plane, w_scale);
+	}
+	vec3_t normal = { coefficients[0], coefficients[1], coefficients[2] };
+	float normal_length = vec3_length(normal);
+	if (normal_length == 0) {
+		return 0;
+	}
+	return (vec3_dot(normal, center) + coefficients[3]) / normal_length;
+}
+
+int classify_bounding_sphere(mat4_t m, vec3_t center, float radius) {
+	// The sphere gets the outcode bit of every plane it is not entirely inside of
+	int or_outcode = 0;
+	for (int plane = 0; plane < NUM_PLANES; plane++) {
+		float distance = sphere_plane_distance(m, center, plane, 1.0f);
+		if (distance < -radius) {
+			return CLIP_TRIVIAL_REJECT;
+		}
+		if (distance < radius) {
+			or_outcode |= FRUSTUM_OUTCODE(plane);
+		}
+	}
+	for (int plane = 0; plane < NUM_SIDE_PLANES; plane++) {
+		if (sphere_plane_distance(m, center, plane, GUARD_BAND_SCALE) < radius) {
+			or_outcode |= GUARD_BAND_OUTCODE(plane);
+		}
+	}
+	return classify_outcodes(0, or_outcode);
+}
+
+int classify_bounding_box(mat4_t m, vec3_t bounds_min, vec3_t bounds_max) {
+	int and_outcode = ~0;
+	int or_outcode = 0;
+	for (int corner = 0; corner < 8; corner++) {
+		vec4_t point = {
+			corner & 1 ? bounds_max.x : bounds_min.x,
+			corner & 2 ? bounds_max.y : bounds_min.y,
+			corner & 4 ? bounds_max.z : bounds_min.z,
+			1
+		};
+		int outcode = compute_outcode(mat4_mul_vec4(m, point));
+		and_outcode &= outcode;
+		or_outcode |= outcode;
+	}
+	return classify_outcodes(and_outcode, or_outcode);
+}
+
+// Clips a line segment against the near and far planes and the guard band, the line rasterizer does the exact side clip
+bool clip_line(vec4_t* a, vec4_t* b) {
+	float t_start = 0;
+	float t_end = 1;
+	for (int plane = 0; plane < NUM_PLANES; plane++) {
+		float w_scale = plane <= BOTTOM_FRUSTUM_PLANE ? GUARD_BAND_SCALE : 1.0f;
+		float distance_a = plane_distance(*a, plane, w_scale);
+		float distance_b = plane_distance(*b, plane, w_scale);
+		if (distance_a < 0 && distance_b < 0) {
+			return false;
+		}
+		if (distance_a < 0) {
+			float t = distance_a / (distance_a - distance_b);
+			if (t > t_start) t_start = t;
+		}
+		else if (distance_b < 0) {
+			float t = distance_a / (distance_a - distance_b);
+			if (t < t_end) t_end = t;
+		}
+	}
+	if (t_start > t_end) {
+		return false;
 	}
 
-	// Copy all vertices from inside_vertices to the destination polygon (out parameter)
-	for (int i = 0; i < num_inside_vertices; i++) {
-		polygon->vertices[i] = vec3_clone(&inside_vertices[i]);
-		polygon->texcoords[i] = tex2_clone(&inside_texcoords[i]);
+	vec4_t start = *a;
+	vec4_t end = *b;
+	if (t_start > 0) {
+		*a = (vec4_t){ float_lerp(start.x, end.x, t_start), float_lerp(start.y, end.y, t_start), float_lerp(start.z, end.z, t_start), float_lerp(start.w, end.w, t_start) };
 	}
-	polygon->num_vertices = num_inside_vertices;
+	if (t_end < 1) {
+		*b = (vec4_t){ float_lerp(start.x, end.x, t_end), float_lerp(start.y, end.y, t_end), float_lerp(start.z, end.z, t_end), float_lerp(start.w, end.w, t_end) };
+	}
+	return true;
 }
 
-void clip_polygon(polygon_t* polygon) {
-	clip_polygon_against_plane(polygon, LEFT_FRUSTUM_PLANE);
-	clip_polygon_against_plane(polygon, RIGHT_FRUSTUM_PLANE);
-	clip_polygon_against_plane(polygon, TOP_FRUSTUM_PLANE);
-	clip_polygon_against_plane(polygon, BOTTOM_FRUSTUM_PLANE);
-	clip_polygon_against_plane(polygon, NEAR_FRUSTUM_PLANE);
-	clip_polygon_against_plane(polygon, FAR_FRUSTUM_PLANE);
+void clip_polygon(polygon_t* polygon, int outcode) {
+	// Planes that no vertex is outside of are skipped, the others alternate between the polygon and a scratch polygon
+	polygon_t scratch;
+	polygon_t* source = polygon;
+	polygon_t* destination = &scratch;
+
+	// The near plane keeps the perspective divide away from zero, and the far plane bounds the depth range
+	for (int plane = NEAR_FRUSTUM_PLANE; plane <= FAR_FRUSTUM_PLANE; plane++) {
+		if (outcode & FRUSTUM_OUTCODE(plane)) {
+			clip_polygon_against_plane(source, destination, plane);
+			polygon_t* clipped = destination;
+			destination = source;
+			source = clipped;
+		}
+	}
+
+	// Side planes are left to the rasterizer scissor unless what is left after the near clip still leaves the guard band
+	for (int plane = LEFT_FRUSTUM_PLANE; plane <= BOTTOM_FRUSTUM_PLANE; plane++) {
+		bool is_clipped = is_guard_band
+			? (outcode & GUARD_BAND_OUTCODE(plane)) && !is_polygon_inside_guard_band(source, plane)
+			: (outcode & FRUSTUM_OUTCODE(plane));
+		if (is_clipped) {
+			clip_polygon_against_plane(source, destination, plane);
+			polygon_t* clipped = destination;
+			destination = source;
+			source = clipped;
+			if (is_guard_band) {
+				add_stat(STAT_GUARD_BAND_CLIPS, 1);
+			}
+		}
+	}
+
+	if (source != polygon) {
+		*polygon = *source;
+	}
 }
\ No newline at end of file
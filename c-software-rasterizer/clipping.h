@@ -1,12 +1,23 @@
 #ifndef CLIPPING_H
 #define CLIPPING_H
 
+#include <stdbool.h>
+#include "matrix.h"
 #include "triangle.h"
 #include "vector.h"
 
 #define MAX_NUM_POLY_VERTICES 10
 #define MAX_NUM_POLY_TRIANGLES 10
 
+// Values interpolated alongside the position of every polygon vertex (u and v for textured meshes)
+#define MAX_NUM_POLY_ATTRIBUTES 4
+
+// The guard band is this many times wider and taller than the view, and the rasterizer scissors everything inside it
+#define GUARD_BAND_SCALE 8.0
+
+#define NUM_PLANES 6
+#define NUM_SIDE_PLANES 4
+
 enum {
 	LEFT_FRUSTUM_PLANE,
 	RIGHT_FRUSTUM_PLANE,
@@ -16,21 +27,35 @@ enum {
 	FAR_FRUSTUM_PLANE
 };
 
-typedef struct {
-	vec3_t point;
-	vec3_t normal;
-} plane_t;
+// Outcode bits of a vertex outside a frustum plane or outside a guard band side plane
+#define FRUSTUM_OUTCODE(plane) (1 << (plane))
+#define GUARD_BAND_OUTCODE(plane) (1 << (NUM_PLANES + (plane)))
+#define FRUSTUM_OUTCODE_MASK ((1 << NUM_PLANES) - 1)
+#define GUARD_BAND_OUTCODE_MASK (((1 << NUM_SIDE_PLANES) - 1) << NUM_PLANES)
+
+enum clip_classification {
+	CLIP_TRIVIAL_ACCEPT,	// Every vertex is inside the planes that need a real clip
+	CLIP_TRIVIAL_REJECT,	// Every vertex is outside the same frustum plane
+	CLIP_NEEDED
+};
 
+// Polygon in homogeneous clip space, where the view volume is -w <= x <= w, -w <= y <= w, and 0 <= z <= w
 typedef struct {
-	vec3_t vertices[MAX_NUM_POLY_VERTICES];
-	tex2_t texcoords[MAX_NUM_POLY_VERTICES];
+	vec4_t vertices[MAX_NUM_POLY_VERTICES];
+	float attributes[MAX_NUM_POLY_VERTICES][MAX_NUM_POLY_ATTRIBUTES];
 	int num_vertices;
+	int num_attributes;
 } polygon_t;
 
-void init_frustum_planes(float fov_X, float fov_y, float z_near, float z_far);
-polygon_t create_polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2, tex2_t t0, tex2_t t1, tex2_t t2);
+void set_guard_band(bool is_enabled);
+bool is_guard_band_enabled(void);
+polygon_t create_polygon_from_triangle(vec4_t v0, vec4_t v1, vec4_t v2, tex2_t t0, tex2_t t1, tex2_t t2);
 void triangles_from_polygon(polygon_t* polygon, triangle_t triangles[], int* num_triangles);
-void clip_polygon_against_plane(polygon_t* polygon, int plane);
-void clip_polygon(polygon_t* polygon);
+int compute_outcode(vec4_t point);
+int classify_triangle(int outcode0, int outcode1, int outcode2);
+int classify_bounding_sphere(mat4_t m, vec3_t center, float radius);
+int classify_bounding_box(mat4_t m, vec3_t bounds_min, vec3_t bounds_max);
+void clip_polygon(polygon_t* polygon, int outcode);
+bool clip_line(vec4_t* a, vec4_t* b);
 
 #endif
\ No newline at end of file
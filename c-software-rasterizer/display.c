@@ -1,15 +1,59 @@
+#include <string.h>
 #include "display.h"
+#include "stats.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DISPLAY_HAS_STREAMING_STORES
+#include <emmintrin.h>
+#endif
 
 static SDL_Window* window = NULL;
 static SDL_Renderer* renderer = NULL;
-static uint32_t* color_buffer = NULL;
-static float* z_buffer = NULL;
+static uint32_t* color_buffer = NULL;			// Blocks of the tiled layout, or the rows of pixels the linear layout draws into
+static uint32_t* tiled_color_buffer = NULL;
+static uint32_t* present_buffers[NUM_PRESENT_BUFFERS];	// Rows of pixels for SDL, one per frame that can be in flight
+static int back_buffer = 0;					// Present buffer of the frame the main thread is drawing
+static int color_pitch = 0;					// Pixels from one row of the color buffer to the next in the linear layout
+static uint32_t* locked_pixels = NULL;		// Memory of the locked texture, NULL while it is unlocked
+static int locked_pitch = 0;
+static void* z_buffer = NULL;	// Floats or integers of the depth format
+static float* hiz_buffer = NULL;
+static int hiz_width = 0;
+static int hiz_height = 0;
+static uint8_t* block_clear_flags = NULL;	// BLOCK_COLOR_CLEARED and BLOCK_DEPTH_CLEARED bits of every 8x8 block
+static uint32_t* grid_image = NULL;			// Cleared color buffer with the dot-matrix, in rows of pixels
+static uint32_t grid_image_color = 0;
+static bool is_grid_image_built = false;
+static uint32_t clear_color = 0xFF000000;
+static bool is_grid_visible = false;
+static int eagerly_cleared_buffers = 0;	// Buffers the last clear wrote in full, whose cleared blocks only need their flag dropped
+static int num_color_blocks_drawn = 0;	// Blocks drawn into during the last frame, which picks how the next frame is cleared
+static int num_depth_blocks_drawn = 0;
+static bool has_streaming_stores = false;	// The CPU running the program has the SSE2 non-temporal stores
 static SDL_Texture* color_buffer_texture = NULL;
 static int grid_spacing = 10;	// Current space between grid lines is 10 pixels
 static int window_width = 1920;	// Sets window render width (16:9)
 static int window_height = 1080;	// Sets window render height (16:9)
 static int render_method = 0;
 static int cull_method = 0;
+static int render_backend = 0;
+static int buffer_layout = 0;
+static int depth_format = 0;
+static bool is_depth_tested = true;
+static int present_mode = PRESENT_MODE_COPY;
+static SDL_Thread* presenter = NULL;		// Thread that owns the renderer and makes every SDL render call
+static SDL_sem* presenter_wakeup = NULL;	// Posted for every frame handed over and every render job
+static SDL_sem* render_job_done = NULL;		// Posted by the presenter when the render job the main thread waits on is done
+static void* render_job = NULL;				// Function the main thread waits on, run by the presenter
+static SDL_atomic_t ready_buffer;			// Newest finished present buffer, with PRESENT_BUFFER_FRESH set until the presenter takes it
+static SDL_atomic_t is_presenter_quitting;
+static int front_buffer = 0;				// Present buffer the presenter thread shows, owned by that thread
+static const uint32_t* present_source = NULL;	// Rows the copy present job copies into the texture
+static int present_source_pitch = 0;
+static float depth_scale = 0;	// Integer depth is depth_offset + depth_scale * 1/w, before it is scaled to the range of the format
+static float depth_offset = 0;
+
+static bool start_presenter(void);
 
 int get_window_width(void) {
 	return window_width;
@@ -19,6 +63,22 @@ int get_window_height(void) {
 	return window_height;
 }
 
+uint32_t* get_color_buffer(void) {
+	return color_buffer;
+}
+
+void* get_z_buffer(void) {
+	return z_buffer;
+}
+
+float* get_hiz_buffer(void) {
+	return hiz_buffer;
+}
+
+int get_hiz_width(void) {
+	return hiz_width;
+}
+
 bool initialize_window(void) {
 	if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
 		fprintf(stderr, "Error initializing SDL.\n");
@@ -51,35 +111,41 @@ bool initialize_window(void) {
 		fprintf(stderr, "Error creating SDL window.\n");
 		return false;
 	}
-	// Create SDL renderer
-	renderer = SDL_CreateRenderer(window, -1, 0);
-	if (!renderer) {
-		fprintf(stderr, "Error creating SDL renderer.\n");
-		return false;
-	}
 	SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN);
 
-	// Allocate required memory in bytes to hold the color buffer and z-buffer
-	color_buffer = (uint32_t*)malloc(sizeof(uint32_t) * window_width * window_height);
-	z_buffer = (float*)malloc(sizeof(float) * window_width * window_height);
+#ifdef DISPLAY_HAS_STREAMING_STORES
+	has_streaming_stores = SDL_HasSSE2();
+#endif
 
-	// Create an SDL texture to display the color buffer
-	color_buffer_texture = SDL_CreateTexture(
-		renderer,
-		// Previously SDL_PIXELFORMAT_ARGB8888
-		SDL_PIXELFORMAT_RGBA32,
-		SDL_TEXTUREACCESS_STREAMING,
-		window_width,
-		window_height
-	);
+	// Allocate one farthest depth value per 8x8 block of the z-buffer
+	hiz_width = (window_width + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+	hiz_height = (window_height + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+	hiz_buffer = (float*)malloc(sizeof(float) * hiz_width * hiz_height);
+	block_clear_flags = (uint8_t*)malloc(hiz_width * hiz_height);
 
-	return true;
+	// Allocate required memory in bytes to hold the color buffer and z-buffer, rounded up to whole blocks for the tiled layout
+	int num_buffer_pixels = hiz_width * hiz_height * HIZ_BLOCK_SIZE * HIZ_BLOCK_SIZE;
+	tiled_color_buffer = (uint32_t*)malloc(sizeof(uint32_t) * num_buffer_pixels);
+	for (int i = 0; i < NUM_PRESENT_BUFFERS; i++) {
+		present_buffers[i] = (uint32_t*)malloc(sizeof(uint32_t) * num_buffer_pixels);
+	}
+	color_buffer = present_buffers[back_buffer];
+	color_pitch = window_width;
+	z_buffer = malloc(sizeof(float) * num_buffer_pixels);
+	grid_image = (uint32_t*)malloc(sizeof(uint32_t) * window_width * window_height);
+
+	// Create the SDL renderer and texture on the thread that presents
+	return start_presenter();
 }
 
 void set_render_method(int method) {
 	render_method = method;
 }
 
+int get_render_method(void) {
+	return render_method;
+}
+
 void set_cull_method(int method) {
 	cull_method = method;
 }
@@ -88,6 +154,253 @@ bool is_cull_backface(void) {
 	return cull_method == CULL_BACKFACE;
 }
 
+void set_render_backend(int backend) {
+	render_backend = backend;
+}
+
+bool is_render_backend_tiled(void) {
+	return render_backend == RENDER_BACKEND_TILED;
+}
+
+void set_buffer_layout(int layout) {
+	buffer_layout = layout;
+}
+
+bool is_buffer_layout_tiled(void) {
+	return buffer_layout == BUFFER_LAYOUT_TILED;
+}
+
+// Without a presenter thread the async mode falls back to copying
+void set_present_mode(int mode) {
+	present_mode = (mode == PRESENT_MODE_ASYNC && presenter == NULL) ? PRESENT_MODE_COPY : mode;
+}
+
+int get_present_mode(void) {
+	return present_mode;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Pixel addressing
+///////////////////////////////////////////////////////////////////////////////
+// The tiled layout stores the color buffer and z-buffer as 8x8 blocks, the
+// same blocks the rasterizer and the hierarchical z-buffer walk, one after the
+// other in rows of blocks. Inside a block the pixels are in rows of 8, so a
+// span that stays inside one block is still contiguous in memory, and a whole
+// block is 256 bytes instead of eight rows that are a full screen apart.
+///////////////////////////////////////////////////////////////////////////////
+static inline int pixel_index(int x, int y) {
+	if (buffer_layout == BUFFER_LAYOUT_TILED) {
+		int block_index = (y / HIZ_BLOCK_SIZE) * hiz_width + (x / HIZ_BLOCK_SIZE);
+		return (block_index * HIZ_BLOCK_SIZE + (y % HIZ_BLOCK_SIZE)) * HIZ_BLOCK_SIZE + (x % HIZ_BLOCK_SIZE);
+	}
+	return (window_width * y) + x;
+}
+
+int get_pixel_index(int x, int y) {
+	return pixel_index(x, y);
+}
+
+// The color buffer differs from the z-buffer only when its rows are those of the locked texture, which may be padded
+static inline int color_pixel_index(int x, int y) {
+	if (buffer_layout == BUFFER_LAYOUT_TILED) {
+		return pixel_index(x, y);
+	}
+	return (color_pitch * y) + x;
+}
+
+int get_color_pixel_index(int x, int y) {
+	return color_pixel_index(x, y);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Depth formats
+///////////////////////////////////////////////////////////////////////////////
+// The float format keeps 1 - 1/w. The integer formats keep z/w, which is 0 at
+// the near plane and 1 at the far plane and is also linear in 1/w:
+//
+// z/w = far / (far - near) - far * near / (far - near) * 1/w
+//
+// Depth value k in [1, max] holds z/w from (k - 1) / max up to k / max, so
+// triangle setup only needs a scale and an offset and the shaders truncate.
+// The value 0 is never a depth and marks pixels the textured pass of the
+// depth pre-pass has shaded, like the NaN of the float format.
+///////////////////////////////////////////////////////////////////////////////
+void set_depth_format(int format) {
+	depth_format = format;
+}
+
+int get_depth_format(void) {
+	return depth_format;
+}
+
+// Without the depth test triangles are drawn in submission order and the z-buffer is neither read nor written
+void set_depth_test(bool is_enabled) {
+	is_depth_tested = is_enabled;
+}
+
+bool is_depth_test_enabled(void) {
+	return is_depth_tested;
+}
+
+void set_depth_range(float z_near, float z_far) {
+	depth_offset = z_far / (z_far - z_near);
+	depth_scale = -z_far * z_near / (z_far - z_near);
+}
+
+float get_depth_scale(void) {
+	return depth_scale;
+}
+
+float get_depth_offset(void) {
+	return depth_offset;
+}
+
+static uint32_t get_depth_format_max(void) {
+	return depth_format == DEPTH_FORMAT_UNORM16 ? UNORM16_DEPTH_MAX : UNORM24_DEPTH_MAX;
+}
+
+// Converts 1 - 1/w to an integer depth with the same math as the span shaders
+static uint32_t to_integer_depth(float depth) {
+	float max = get_depth_format_max();
+	float value = (1 + max * depth_offset) + (max * depth_scale) * (1.0f - depth);
+	value = value < 1 ? 1 : (value > max ? max : value);
+	return (uint32_t)value;
+}
+
+// Inverse of to_integer_depth at the near end of the range of the value, the cleared value reads back as the cleared float depth
+static float from_integer_depth(uint32_t value) {
+	float max = get_depth_format_max();
+	if (value >= max) {
+		return 1.0;
+	}
+	return 1.0f - (((float)value - 1) / max - depth_offset) / depth_scale;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fast clears
+///////////////////////////////////////////////////////////////////////////////
+// Clearing only sets a flag per 8x8 block and buffer. The first time anything
+// draws into a block, resolve_cleared_block() writes the cleared values of
+// that block, and the blocks nothing was drawn into are filled with the clear
+// color (or the grid image) straight into the rows handed to SDL. The depth of
+// those blocks is never written at all.
+//
+// Writing a block on its own costs several times its share of one pass over
+// the whole buffer, so when the last frame drew into more than a quarter of
+// the blocks of a buffer, the next clear writes that buffer in full instead
+// and the flags are only kept to count the blocks that get drawn.
+///////////////////////////////////////////////////////////////////////////////
+#define EAGER_CLEAR_BLOCK_SHARE 4
+
+static inline void write_cleared_color_row(uint32_t* destination, int x, int y, int count) {
+	if (is_grid_visible) {
+		memcpy(destination, &grid_image[(window_width * y) + x], sizeof(uint32_t) * count);
+		return;
+	}
+	for (int i = 0; i < count; i++) {
+		destination[i] = clear_color;
+	}
+}
+
+static inline void write_cleared_depth_row(int index, int count) {
+	switch (depth_format) {
+		case DEPTH_FORMAT_UNORM24:
+			for (int i = 0; i < count; i++) {
+				((uint32_t*)z_buffer)[index + i] = UNORM24_DEPTH_MAX;
+			}
+			break;
+		case DEPTH_FORMAT_UNORM16:
+			for (int i = 0; i < count; i++) {
+				((uint16_t*)z_buffer)[index + i] = UNORM16_DEPTH_MAX;
+			}
+			break;
+		default:
+			for (int i = 0; i < count; i++) {
+				((float*)z_buffer)[index + i] = 1.0;
+			}
+			break;
+	}
+}
+
+static inline void write_cleared_block_rows(int block_x, int block_y, int end_y, int count, int pending) {
+	for (int row_y = block_y; row_y < end_y; row_y++) {
+		if (pending & BLOCK_COLOR_CLEARED) {
+			write_cleared_color_row(&color_buffer[color_pixel_index(block_x, row_y)], block_x, row_y, count);
+		}
+		if (pending & BLOCK_DEPTH_CLEARED) {
+			write_cleared_depth_row(pixel_index(block_x, row_y), count);
+		}
+	}
+}
+
+// Same as write_cleared_color_row with non-temporal stores, for rows that are only read again by SDL
+static void stream_cleared_color_row(uint32_t* destination, int x, int y, int count) {
+	const uint32_t* source = &grid_image[(window_width * y) + x];
+	int i = 0;
+#ifdef DISPLAY_HAS_STREAMING_STORES
+	if (has_streaming_stores) {
+		while (i < count && ((uintptr_t)&destination[i] & 15) != 0) {
+			destination[i] = is_grid_visible ? source[i] : clear_color;
+			i++;
+		}
+		__m128i color = _mm_set1_epi32((int)clear_color);
+		for (; i + 4 <= count; i += 4) {
+			_mm_stream_si128((__m128i*)&destination[i], is_grid_visible ? _mm_loadu_si128((const __m128i*)&source[i]) : color);
+		}
+	}
+#endif
+	for (; i < count; i++) {
+		destination[i] = is_grid_visible ? source[i] : clear_color;
+	}
+}
+
+// Fills 32-bit words with non-temporal stores, an eager clear is larger than the caches and is not read back soon
+static void stream_fill(uint32_t* destination, uint32_t value, int count) {
+	int i = 0;
+#ifdef DISPLAY_HAS_STREAMING_STORES
+	if (has_streaming_stores) {
+		while (i < count && ((uintptr_t)&destination[i] & 15) != 0) {
+			destination[i++] = value;
+		}
+		__m128i values = _mm_set1_epi32((int)value);
+		for (; i + 4 <= count; i += 4) {
+			_mm_stream_si128((__m128i*)&destination[i], values);
+		}
+		_mm_sfence();
+	}
+#endif
+	for (; i < count; i++) {
+		destination[i] = value;
+	}
+}
+
+// Writes the cleared values of the given buffers into the block holding (x, y) if they are still pending
+void resolve_cleared_block(int x, int y, int buffers) {
+	int block_index = (y / HIZ_BLOCK_SIZE) * hiz_width + (x / HIZ_BLOCK_SIZE);
+	int pending = block_clear_flags[block_index] & buffers;
+	if (pending == 0) {
+		return;
+	}
+	block_clear_flags[block_index] &= ~pending;
+	pending &= ~eagerly_cleared_buffers;
+	if (pending == 0) {
+		return;
+	}
+
+	int block_x = x - x % HIZ_BLOCK_SIZE;
+	int block_y = y - y % HIZ_BLOCK_SIZE;
+	int count = window_width - block_x < HIZ_BLOCK_SIZE ? window_width - block_x : HIZ_BLOCK_SIZE;
+	int end_y = window_height - block_y < HIZ_BLOCK_SIZE ? window_height : block_y + HIZ_BLOCK_SIZE;
+
+	// Rows of whole blocks have a constant length, so they compile to a few wide moves
+	if (count == HIZ_BLOCK_SIZE) {
+		write_cleared_block_rows(block_x, block_y, end_y, HIZ_BLOCK_SIZE, pending);
+	}
+	else {
+		write_cleared_block_rows(block_x, block_y, end_y, count, pending);
+	}
+}
+
 bool should_render_filled_triangles(void) {
 	return (
 		render_method == RENDER_FILL_TRIANGLE || 
@@ -100,7 +413,8 @@ bool should_render_textured_triangles(void) {
 	return (
 		render_method == RENDER_TEXTURED ||
 		render_method == RENDER_TEXTURED_WIRE ||
-		render_method == RENDER_TEXTURED_WIRE_VERTEX
+		render_method == RENDER_TEXTURED_WIRE_VERTEX ||
+		render_method == RENDER_TEXTURED_DEPTH_PREPASS
 	);
 }
 
@@ -123,12 +437,37 @@ bool should_render_vertices(void) {
 	);
 }
 
+// The pre-pass only exists for the depth test of the textured pass
+bool should_render_depth_prepass(void) {
+	return render_method == RENDER_TEXTURED_DEPTH_PREPASS && is_depth_tested;
+}
+
 // This version draws a dot-matrix on-screen
+// After a lazy clear the dots are part of the grid image that every cleared row is copied from, so each block starts out with them
+// when it is first drawn into or handed to SDL, and triangles drawn afterwards cover them like they would after an eager clear
 void draw_grid(void) {
-	for (int y = 0; y < window_height; y += grid_spacing) {
-		for (int x = 0; x < window_width; x += grid_spacing) {
-			color_buffer[(window_width * y) + x] = 0xFF8e918f; // Sets matrix color to grey
+	is_grid_visible = true;
+	if (eagerly_cleared_buffers & BLOCK_COLOR_CLEARED) {
+		for (int y = 0; y < window_height; y += grid_spacing) {
+			for (int x = 0; x < window_width; x += grid_spacing) {
+				color_buffer[color_pixel_index(x, y)] = 0xFF8e918f; // Sets matrix color to grey
+			}
 		}
+		return;
+	}
+
+	// The image is only rebuilt when the clear color changes
+	if (!is_grid_image_built || grid_image_color != clear_color) {
+		for (int i = 0; i < window_width * window_height; i++) {
+			grid_image[i] = clear_color;
+		}
+		for (int y = 0; y < window_height; y += grid_spacing) {
+			for (int x = 0; x < window_width; x += grid_spacing) {
+				grid_image[(window_width * y) + x] = 0xFF8e918f; // Sets matrix color to grey
+			}
+		}
+		grid_image_color = clear_color;
+		is_grid_image_built = true;
 	}
 }
 
@@ -150,57 +489,420 @@ void draw_pixel(int x, int y, uint32_t color) {
 	if (x < 0 || x >= window_width || y < 0 || y >= window_height) {
 		return;
 	}
-	color_buffer[(window_width * y) + x] = color;
+	resolve_cleared_block(x, y, BLOCK_COLOR_CLEARED);
+	color_buffer[color_pixel_index(x, y)] = color;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Integer line drawing
+///////////////////////////////////////////////////////////////////////////////
+// A line takes one pixel per step along its major axis, and after i steps its
+// minor axis has moved round(i * d / n) pixels, where n and d are the major
+// and minor lengths. That is floor((2 * i * d + n) / (2 * n)), which Bresenham
+// keeps as a quotient and a remainder updated with one add per step. Because
+// the minor offset only grows with i, the range of steps that lands inside
+// the viewport follows from two divisions per axis, so the line is clipped
+// exactly before the first pixel and starts mid-way with the same remainder
+// it would have had there.
+///////////////////////////////////////////////////////////////////////////////
+static int64_t floor_div(int64_t a, int64_t b) {
+	int64_t q = a / b;
+	return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
 }
 
 void draw_line(int x0, int y0, int x1, int y1, uint32_t color) {
-	int delta_x = (x1 - x0); // Calculate delta-x
-	int delta_y = (y1 - y0); // Calculate delta-y
-	// Calculate which side is the longest
-	int longest_side_length = (abs(delta_x) >= abs(delta_y)) ? abs(delta_x) : abs(delta_y);
-	float x_inc = delta_x / (float)longest_side_length; // Calculate x-increment
-	float y_inc = delta_y / (float)longest_side_length; // Calculate y-increment
-	float current_x = x0;
-	float current_y = y0;
-	// Loop to draw edge lines, pixel by pixel
-	for (int i = 0; i <= longest_side_length; i++) {
-		draw_pixel(round(current_x), round(current_y), color);
-		current_x += x_inc;
-		current_y += y_inc;
-	}
-}
-
-// The function for drawing a rectangle on-screen
+	int delta_x = x1 - x0;
+	int delta_y = y1 - y0;
+	if (delta_x == 0 && delta_y == 0) {
+		draw_pixel(x0, y0, color);
+		return;
+	}
+	bool is_x_major = abs(delta_x) >= abs(delta_y);
+
+	// Name the axes by their role so one loop handles every octant
+	int major_start = is_x_major ? x0 : y0;
+	int minor_start = is_x_major ? y0 : x0;
+	int major_sign = (is_x_major ? delta_x : delta_y) < 0 ? -1 : 1;
+	int minor_sign = (is_x_major ? delta_y : delta_x) < 0 ? -1 : 1;
+	int64_t n = abs(is_x_major ? delta_x : delta_y);
+	int64_t d = abs(is_x_major ? delta_y : delta_x);
+	int major_limit = is_x_major ? window_width : window_height;
+	int minor_limit = is_x_major ? window_height : window_width;
+
+	// Steps whose major coordinate is inside the viewport
+	int64_t first_step = major_sign > 0 ? -major_start : major_start - (major_limit - 1);
+	int64_t last_step = major_sign > 0 ? (major_limit - 1) - major_start : major_start;
+	if (first_step < 0) first_step = 0;
+	if (last_step > n) last_step = n;
+
+	// Minor offsets that are inside the viewport, narrowed to the steps that produce them
+	int64_t min_offset = minor_sign > 0 ? -minor_start : minor_start - (minor_limit - 1);
+	int64_t max_offset = minor_sign > 0 ? (minor_limit - 1) - minor_start : minor_start;
+	if (d == 0) {
+		if (min_offset > 0 || max_offset < 0) {
+			return;
+		}
+	}
+	else {
+		int64_t first_inside = -floor_div(-(2 * n * min_offset - n), 2 * d);
+		int64_t last_inside = floor_div(2 * n * (max_offset + 1) - n - 1, 2 * d);
+		if (first_step < first_inside) first_step = first_inside;
+		if (last_step > last_inside) last_step = last_inside;
+	}
+	if (first_step > last_step) {
+		return;
+	}
+
+	// Resume the minor offset and its remainder at the first visible step
+	int64_t numerator = 2 * first_step * d + n;
+	int minor_offset = (int)(numerator / (2 * n));
+	int64_t remainder = numerator % (2 * n);
+
+	int x = is_x_major ? major_start + major_sign * (int)first_step : minor_start + minor_sign * minor_offset;
+	int y = is_x_major ? minor_start + minor_sign * minor_offset : major_start + major_sign * (int)first_step;
+	int major_step_x = is_x_major ? major_sign : 0;
+	int major_step_y = is_x_major ? 0 : major_sign;
+	int minor_step_x = is_x_major ? 0 : minor_sign;
+	int minor_step_y = is_x_major ? minor_sign : 0;
+
+	// Loop to draw the visible part of the line straight into the color buffer, pixel by pixel
+	for (int64_t step = first_step; step <= last_step; step++) {
+		resolve_cleared_block(x, y, BLOCK_COLOR_CLEARED);
+		color_buffer[color_pixel_index(x, y)] = color;
+		x += major_step_x;
+		y += major_step_y;
+		remainder += 2 * d;
+		if (remainder >= 2 * n) {
+			remainder -= 2 * n;
+			x += minor_step_x;
+			y += minor_step_y;
+		}
+	}
+}
+
+// The function for drawing a rectangle on-screen, clipped to the screen once instead of at every pixel
 void draw_rect(int x, int y, int width, int height, uint32_t color) {
-	for (int i = 0; i < width; i++) {
-		for (int j = 0; j < height; j++) {
-			int current_x = x + i;
-			int current_y = y + j;
-			draw_pixel(current_x, current_y, color);
+	int min_x = x < 0 ? 0 : x;
+	int min_y = y < 0 ? 0 : y;
+	int max_x = x + width > window_width ? window_width : x + width;
+	int max_y = y + height > window_height ? window_height : y + height;
+	for (int block_y = min_y - min_y % HIZ_BLOCK_SIZE; block_y < max_y; block_y += HIZ_BLOCK_SIZE) {
+		for (int block_x = min_x - min_x % HIZ_BLOCK_SIZE; block_x < max_x; block_x += HIZ_BLOCK_SIZE) {
+			resolve_cleared_block(block_x, block_y, BLOCK_COLOR_CLEARED);
+		}
+	}
+	for (int current_y = min_y; current_y < max_y; current_y++) {
+		for (int current_x = min_x; current_x < max_x; current_x++) {
+			color_buffer[color_pixel_index(current_x, current_y)] = color;
 		}
 	}
 }
 
-void render_color_buffer(void) {
-	SDL_UpdateTexture(
-		color_buffer_texture,
-		NULL,
-		color_buffer,
-		(int)(window_width * sizeof(uint32_t))
+///////////////////////////////////////////////////////////////////////////////
+// Presentation
+///////////////////////////////////////////////////////////////////////////////
+// SDL_UpdateTexture copies a whole frame of pixels into the texture. With
+// the locked present mode the texture is locked when the frame is cleared and
+// the linear layout renders straight into its memory, a row pitch apart, so
+// unlocking it is all that is left to present. The tiled layout still renders
+// into its own blocks, but copies them out into the locked texture instead of
+// into rows of its own. Renderers that cannot lock a streaming texture, or
+// where locked memory is slow to write to, use the copy mode.
+//
+// SDL renderers only work on the thread that created them, so a presenter
+// thread creates the renderer and its texture and makes every SDL render call
+// of the program. In the copy and locked modes the main thread hands it one
+// render job at a time and waits for it. The async mode leaves the copy and
+// SDL_RenderPresent to the presenter without waiting, so they overlap with the
+// next update() and render(). The frames cycle through three present buffers
+// as a mailbox: the main thread draws into the back buffer, the presenter
+// shows the front buffer, and the third one is the newest finished frame.
+// Handing a frame over swaps the back buffer with that one in a single atomic
+// exchange, and the presenter swaps its front buffer with it the same way, so
+// neither thread waits on the other and a frame the presenter had no time for
+// is replaced by a newer one. When the thread cannot start, the main thread
+// creates the renderer and runs the render jobs itself.
+///////////////////////////////////////////////////////////////////////////////
+#define PRESENT_BUFFER_FRESH 0x100
+
+typedef void (*render_job_t)(void);
+
+static bool create_renderer(void) {
+	renderer = SDL_CreateRenderer(window, -1, 0);
+	if (!renderer) {
+		fprintf(stderr, "Error creating SDL renderer.\n");
+		return false;
+	}
+
+	// Create an SDL texture to display the color buffer
+	color_buffer_texture = SDL_CreateTexture(
+		renderer,
+		// Previously SDL_PIXELFORMAT_ARGB8888
+		SDL_PIXELFORMAT_RGBA32,
+		SDL_TEXTUREACCESS_STREAMING,
+		window_width,
+		window_height
 	);
+	return true;
+}
+
+static void destroy_renderer(void) {
+	if (locked_pixels != NULL) {
+		SDL_UnlockTexture(color_buffer_texture);
+		locked_pixels = NULL;
+	}
+	SDL_DestroyRenderer(renderer);
+	renderer = NULL;
+}
+
+static void present_rows(const uint32_t* rows, int pitch) {
+	SDL_UpdateTexture(color_buffer_texture, NULL, rows, (int)(pitch * sizeof(uint32_t)));
 	SDL_RenderCopy(renderer, color_buffer_texture, NULL, NULL);	// Scales set window width and height to fit monitor
 	SDL_RenderPresent(renderer);
 }
 
+static int present_worker(void* data) {
+	bool is_renderer_created = create_renderer();
+	SDL_SemPost(render_job_done);
+	if (!is_renderer_created) {
+		return 0;
+	}
+
+	while (true) {
+		SDL_SemWait(presenter_wakeup);
+
+		// Frames handed over before a render job are shown first, so the frames reach the screen in order
+		if (SDL_AtomicGet(&ready_buffer) & PRESENT_BUFFER_FRESH) {
+			front_buffer = SDL_AtomicSet(&ready_buffer, front_buffer) & ~PRESENT_BUFFER_FRESH;
+			present_rows(present_buffers[front_buffer], window_width);
+		}
+		render_job_t job = (render_job_t)SDL_AtomicSetPtr(&render_job, NULL);
+		if (job != NULL) {
+			job();
+			SDL_SemPost(render_job_done);
+		}
+		if (SDL_AtomicGet(&is_presenter_quitting)) {
+			break;
+		}
+	}
+	destroy_renderer();
+	return 0;
+}
+
+static bool start_presenter(void) {
+	back_buffer = 0;
+	SDL_AtomicSet(&ready_buffer, 1);
+	front_buffer = 2;
+	presenter_wakeup = SDL_CreateSemaphore(0);
+	render_job_done = SDL_CreateSemaphore(0);
+	if (presenter_wakeup != NULL && render_job_done != NULL) {
+		presenter = SDL_CreateThread(present_worker, "presenter", NULL);
+	}
+	if (presenter == NULL) {
+		fprintf(stderr, "Error starting the presenter thread, presenting on the main thread instead.\n");
+		return create_renderer();
+	}
+
+	// Wait for the presenter to create the renderer
+	SDL_SemWait(render_job_done);
+	if (renderer == NULL) {
+		SDL_WaitThread(presenter, NULL);
+		presenter = NULL;
+		return false;
+	}
+	return true;
+}
+
+static void stop_presenter(void) {
+	if (presenter != NULL) {
+		SDL_AtomicSet(&is_presenter_quitting, 1);
+		SDL_SemPost(presenter_wakeup);
+		SDL_WaitThread(presenter, NULL);
+		presenter = NULL;
+	}
+	else if (renderer != NULL) {
+		destroy_renderer();
+	}
+	if (presenter_wakeup != NULL) {
+		SDL_DestroySemaphore(presenter_wakeup);
+		presenter_wakeup = NULL;
+	}
+	if (render_job_done != NULL) {
+		SDL_DestroySemaphore(render_job_done);
+		render_job_done = NULL;
+	}
+}
+
+// Runs the job on the thread that owns the renderer and returns once it is done
+static void run_render_job(render_job_t job) {
+	if (presenter == NULL) {
+		job();
+		return;
+	}
+	SDL_AtomicSetPtr(&render_job, (void*)job);
+	SDL_SemPost(presenter_wakeup);
+	SDL_SemWait(render_job_done);
+}
+
+// The ready buffer becomes the new back buffer, the presenter is woken up after the frame is in the mailbox
+static void hand_over_back_buffer(void) {
+	back_buffer = SDL_AtomicSet(&ready_buffer, back_buffer | PRESENT_BUFFER_FRESH) & ~PRESENT_BUFFER_FRESH;
+	SDL_SemPost(presenter_wakeup);
+}
+
+static void present_source_rows(void) {
+	present_rows(present_source, present_source_pitch);
+}
+
+static void lock_texture(void) {
+	void* pixels = NULL;
+	int pitch = 0;
+	if (SDL_LockTexture(color_buffer_texture, NULL, &pixels, &pitch) != 0) {
+		return;
+	}
+	locked_pixels = (uint32_t*)pixels;
+	locked_pitch = pitch / (int)sizeof(uint32_t);
+}
+
+static void unlock_and_present_texture(void) {
+	SDL_UnlockTexture(color_buffer_texture);
+	locked_pixels = NULL;
+	SDL_RenderCopy(renderer, color_buffer_texture, NULL, NULL);
+	SDL_RenderPresent(renderer);
+}
+
+static void lock_color_buffer_texture(void) {
+	run_render_job(lock_texture);
+	if (locked_pixels == NULL) {
+		fprintf(stderr, "Error locking SDL texture, copying the color buffer instead.\n");
+		present_mode = PRESENT_MODE_COPY;
+	}
+}
+
+// Picks the memory the next frame is drawn into
+static void select_color_buffer(void) {
+	if (present_mode == PRESENT_MODE_LOCKED && locked_pixels == NULL) {
+		lock_color_buffer_texture();
+	}
+	if (buffer_layout == BUFFER_LAYOUT_TILED) {
+		color_buffer = tiled_color_buffer;
+		color_pitch = window_width;
+	}
+	else if (locked_pixels != NULL) {
+		color_buffer = locked_pixels;
+		color_pitch = locked_pitch;
+	}
+	else {
+		color_buffer = present_buffers[back_buffer];
+		color_pitch = window_width;
+	}
+}
+
+void render_color_buffer(void) {
+	// A single pass fills the blocks still holding the cleared color and copies the rows of every drawn block of the tiled layout
+	// back into the rows of pixels SDL expects, going left to right along each row so the streaming stores fill whole cache lines
+	bool is_tiled = buffer_layout == BUFFER_LAYOUT_TILED;
+	uint32_t* rows = color_buffer;
+	int rows_pitch = color_pitch;
+	if (is_tiled) {
+		rows = locked_pixels != NULL ? locked_pixels : present_buffers[back_buffer];
+		rows_pitch = locked_pixels != NULL ? locked_pitch : window_width;
+	}
+	int unwritten_color = BLOCK_COLOR_CLEARED & ~eagerly_cleared_buffers;
+	for (int y = 0; y < window_height; y++) {
+		uint8_t* row_flags = &block_clear_flags[(y / HIZ_BLOCK_SIZE) * hiz_width];
+		for (int block = 0; block < hiz_width; ) {
+			int x = block * HIZ_BLOCK_SIZE;
+
+			// Runs of cleared blocks are written with one call
+			int end_block = block;
+			while (end_block < hiz_width && (row_flags[end_block] & unwritten_color)) {
+				end_block++;
+			}
+			if (end_block > block) {
+				int end_x = end_block * HIZ_BLOCK_SIZE < window_width ? end_block * HIZ_BLOCK_SIZE : window_width;
+				stream_cleared_color_row(&rows[(rows_pitch * y) + x], x, y, end_x - x);
+				block = end_block;
+				continue;
+			}
+
+			if (is_tiled) {
+				int count = window_width - x < HIZ_BLOCK_SIZE ? window_width - x : HIZ_BLOCK_SIZE;
+				memcpy(&rows[(rows_pitch * y) + x], &color_buffer[pixel_index(x, y)], sizeof(uint32_t) * count);
+			}
+			block++;
+		}
+	}
+#ifdef DISPLAY_HAS_STREAMING_STORES
+	_mm_sfence();
+#endif
+
+	// Blocks that nothing was drawn into this frame
+	int num_blocks_left_cleared = 0;
+	int num_depth_blocks_left_cleared = 0;
+	for (int i = 0; i < hiz_width * hiz_height; i++) {
+		num_blocks_left_cleared += (block_clear_flags[i] & BLOCK_COLOR_CLEARED) != 0;
+		num_depth_blocks_left_cleared += (block_clear_flags[i] & BLOCK_DEPTH_CLEARED) != 0;
+	}
+	num_color_blocks_drawn = hiz_width * hiz_height - num_blocks_left_cleared;
+	num_depth_blocks_drawn = hiz_width * hiz_height - num_depth_blocks_left_cleared;
+	add_stat(STAT_BLOCKS_LEFT_CLEARED, num_blocks_left_cleared);
+
+	if (locked_pixels != NULL) {
+		run_render_job(unlock_and_present_texture);
+	}
+	else if (present_mode == PRESENT_MODE_ASYNC) {
+		hand_over_back_buffer();
+	}
+	else {
+		present_source = rows;
+		present_source_pitch = rows_pitch;
+		run_render_job(present_source_rows);
+	}
+}
+
 void clear_color_buffer(uint32_t color) {
-	for (int i = 0; i < window_width * window_height; i++) {
-		color_buffer[i] = color;
+	select_color_buffer();
+	clear_color = color;
+	is_grid_visible = false;
+	eagerly_cleared_buffers &= ~BLOCK_COLOR_CLEARED;
+	if (num_color_blocks_drawn * EAGER_CLEAR_BLOCK_SHARE > hiz_width * hiz_height) {
+		eagerly_cleared_buffers |= BLOCK_COLOR_CLEARED;
+		int num_rows = buffer_layout == BUFFER_LAYOUT_TILED ? 1 : window_height;
+		int row_length = buffer_layout == BUFFER_LAYOUT_TILED ? hiz_width * hiz_height * HIZ_BLOCK_SIZE * HIZ_BLOCK_SIZE : window_width;
+		for (int y = 0; y < num_rows; y++) {
+			stream_fill(&color_buffer[color_pitch * y], color, row_length);
+		}
+	}
+	for (int i = 0; i < hiz_width * hiz_height; i++) {
+		block_clear_flags[i] |= BLOCK_COLOR_CLEARED;
 	}
 }
 
 void clear_z_buffer(void) {
-	for (int i = 0; i < window_width * window_height; i++) {
-		z_buffer[i] = 1.0;
+	eagerly_cleared_buffers &= ~BLOCK_DEPTH_CLEARED;
+	if (num_depth_blocks_drawn * EAGER_CLEAR_BLOCK_SHARE > hiz_width * hiz_height) {
+		eagerly_cleared_buffers |= BLOCK_DEPTH_CLEARED;
+		int num_pixels = hiz_width * hiz_height * HIZ_BLOCK_SIZE * HIZ_BLOCK_SIZE;
+		float far_depth = 1.0;
+		uint32_t far_depth_bits;
+		memcpy(&far_depth_bits, &far_depth, sizeof(far_depth_bits));
+		switch (depth_format) {
+			case DEPTH_FORMAT_UNORM24:
+				stream_fill((uint32_t*)z_buffer, UNORM24_DEPTH_MAX, num_pixels);
+				break;
+			case DEPTH_FORMAT_UNORM16:
+				// Whole blocks hold an even number of pixels, so the 16-bit depths pair up into words
+				stream_fill((uint32_t*)z_buffer, UNORM16_DEPTH_MAX * 0x10001u, num_pixels / 2);
+				break;
+			default:
+				stream_fill((uint32_t*)z_buffer, far_depth_bits, num_pixels);
+				break;
+		}
+	}
+	for (int i = 0; i < hiz_width * hiz_height; i++) {
+		block_clear_flags[i] |= BLOCK_DEPTH_CLEARED;
+		hiz_buffer[i] = 1.0;
 	}
 }
 
@@ -208,20 +910,46 @@ float get_zbuffer_at(int x, int y) {
 	if (x < 0 || x >= window_width || y < 0 || y >= window_height) {
 		return 1.0;
 	}
-	return z_buffer[(window_width * y) + x];
+	if (block_clear_flags[(y / HIZ_BLOCK_SIZE) * hiz_width + (x / HIZ_BLOCK_SIZE)] & BLOCK_DEPTH_CLEARED) {
+		return 1.0;
+	}
+	int index = pixel_index(x, y);
+	if (depth_format == DEPTH_FORMAT_UNORM24) {
+		return from_integer_depth(((uint32_t*)z_buffer)[index]);
+	}
+	if (depth_format == DEPTH_FORMAT_UNORM16) {
+		return from_integer_depth(((uint16_t*)z_buffer)[index]);
+	}
+	return ((float*)z_buffer)[index];
 }
 
 void update_zbuffer_at(int x, int y, float value) {
 	if (x < 0 || x >= window_width || y < 0 || y >= window_height) {
 		return;
 	}
-	z_buffer[(window_width * y) + x] = value;
+	resolve_cleared_block(x, y, BLOCK_DEPTH_CLEARED);
+	int index = pixel_index(x, y);
+	if (depth_format == DEPTH_FORMAT_UNORM24) {
+		((uint32_t*)z_buffer)[index] = to_integer_depth(value);
+	}
+	else if (depth_format == DEPTH_FORMAT_UNORM16) {
+		((uint16_t*)z_buffer)[index] = (uint16_t)to_integer_depth(value);
+	}
+	else {
+		((float*)z_buffer)[index] = value;
+	}
 }
 
 void destroy_window(void) {
-	free(color_buffer);
+	stop_presenter();
+	free(tiled_color_buffer);
+	for (int i = 0; i < NUM_PRESENT_BUFFERS; i++) {
+		free(present_buffers[i]);
+	}
 	free(z_buffer);
-	SDL_DestroyRenderer(renderer);
+	free(hiz_buffer);
+	free(block_clear_flags);
+	free(grid_image);
 	SDL_DestroyWindow(window);
 	SDL_Quit();
 }
\ No newline at end of file
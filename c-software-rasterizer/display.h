@@ -9,11 +9,51 @@
 #define FPS 60
 #define FRAME_TARGET_TIME (1000 / FPS)
 
+// The hierarchical z-buffer keeps the farthest depth of every 8x8 block of the z-buffer
+#define HIZ_BLOCK_SIZE 8
+
 enum cull_method {
 	CULL_NONE,
 	CULL_BACKFACE
 };
 
+enum render_backend {
+	RENDER_BACKEND_SERIAL,
+	RENDER_BACKEND_TILED
+};
+
+enum buffer_layout {
+	BUFFER_LAYOUT_LINEAR,	// Rows of pixels, as SDL expects them
+	BUFFER_LAYOUT_TILED		// 8x8 blocks of pixels, one after the other
+};
+
+enum present_mode {
+	PRESENT_MODE_COPY,		// Renders into a private buffer that SDL_UpdateTexture copies into the texture
+	PRESENT_MODE_LOCKED,	// Renders straight into the memory of the locked texture
+	PRESENT_MODE_ASYNC,		// Hands finished frames to a presenter thread that copies and presents them
+	NUM_PRESENT_MODES
+};
+
+// Frames that can be in flight in the async present mode: one drawn, one shown, and the newest finished one
+#define NUM_PRESENT_BUFFERS 3
+
+// Values stored in the z-buffer, the integer formats hold z/w scaled to their range and leave 0 free
+enum depth_format {
+	DEPTH_FORMAT_FLOAT32,	// 1 - 1/w as a float
+	DEPTH_FORMAT_UNORM24,	// 24 bits in the low bits of a 32-bit word
+	DEPTH_FORMAT_UNORM16,	// 16 bits, half the bandwidth of the other formats
+	NUM_DEPTH_FORMATS
+};
+
+#define UNORM24_DEPTH_MAX 16777215
+#define UNORM16_DEPTH_MAX 65535
+
+// Buffers of an 8x8 block that still hold their cleared value, which is only written out when something draws into the block
+enum block_clear_flag {
+	BLOCK_COLOR_CLEARED = 1,
+	BLOCK_DEPTH_CLEARED = 2
+};
+
 enum render_method {
 	RENDER_WIRE,
 	RENDER_WIRE_VERTEX,
@@ -22,21 +62,43 @@ enum render_method {
 	RENDER_FILL_TRIANGLE_WIRE_VERTEX,
 	RENDER_TEXTURED,
 	RENDER_TEXTURED_WIRE,
-	RENDER_TEXTURED_WIRE_VERTEX
+	RENDER_TEXTURED_WIRE_VERTEX,
+	RENDER_TEXTURED_DEPTH_PREPASS
 };
 
 bool initialize_window(void);
 int get_window_width(void);
 int get_window_height(void);
+uint32_t* get_color_buffer(void);
+void* get_z_buffer(void);
+float* get_hiz_buffer(void);
+int get_hiz_width(void);
 
 void set_render_method(int method);
+int get_render_method(void);
 void set_cull_method(int method);
 bool is_cull_backface(void);
+void set_render_backend(int backend);
+bool is_render_backend_tiled(void);
+void set_buffer_layout(int layout);
+bool is_buffer_layout_tiled(void);
+int get_pixel_index(int x, int y);
+int get_color_pixel_index(int x, int y);
+void set_present_mode(int mode);
+int get_present_mode(void);
+void set_depth_format(int format);
+int get_depth_format(void);
+void set_depth_test(bool is_enabled);
+bool is_depth_test_enabled(void);
+void set_depth_range(float z_near, float z_far);
+float get_depth_scale(void);
+float get_depth_offset(void);
 
 bool should_render_filled_triangles(void);
 bool should_render_textured_triangles(void);
 bool should_render_wireframe(void);
 bool should_render_vertices(void);
+bool should_render_depth_prepass(void);
 
 void draw_grid(void);
 void draw_pixel(int x, int y, uint32_t color);
@@ -46,6 +108,7 @@ void draw_rect(int x, int y, int width, int height, uint32_t color);
 void render_color_buffer(void);
 void clear_color_buffer(uint32_t color);
 void clear_z_buffer(void);
+void resolve_cleared_block(int x, int y, int buffers);
 float get_zbuffer_at(int x, int y);
 void update_zbuffer_at(int x, int y, float value);
 
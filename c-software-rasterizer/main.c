@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <stdbool.h>
 #include <SDL.h>
 #include "upng.h"
@@ -13,6 +15,9 @@
 #include "triangle.h"
 #include "texture.h"
 #include "mesh.h"
+#include "span.h"
+#include "stats.h"
+#include "tile.h"
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Global variables for execution status and game loop
@@ -22,11 +27,32 @@ int previous_frame_time = 0;
 float delta_time = 0;
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Array to store triangles that should be rendered each frame
+// Queues of the triangles that should be rendered each frame, one per geometry chunk and in submission order.
+// The queues only grow and keep their capacity from frame to frame, so frames that need no more triangles
+// than the frames before them never allocate, and each triangle is written once, into the queue it is drawn from
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#define MAX_TRIANGLES 10000
-triangle_t triangles_to_render[MAX_TRIANGLES];
+#define MIN_TRIANGLE_QUEUE_CAPACITY 64
+
+triangle_queue_t* triangle_queues = NULL;	// Dynamic array with the queue of every geometry chunk
 int num_triangles_to_render = 0;
+int peak_triangles_to_render = 0;			// Most triangles any frame so far queued, over all its queues
+
+// Appends a triangle to the queue, doubling its capacity when it is full, and returns false when it cannot grow
+bool push_triangle(triangle_queue_t* queue, triangle_t triangle) {
+	if (queue->count == queue->capacity) {
+		int capacity = queue->capacity > 0 ? queue->capacity * 2 : MIN_TRIANGLE_QUEUE_CAPACITY;
+		triangle_t* triangles = (triangle_t*)realloc(queue->triangles, sizeof(triangle_t) * capacity);
+		if (triangles == NULL) {
+			fprintf(stderr, "Error growing a queue of triangles to render.\n");
+			return false;
+		}
+		queue->triangles = triangles;
+		queue->capacity = capacity;
+		add_stat(STAT_TRIANGLE_QUEUE_GROWTHS, 1);
+	}
+	queue->triangles[queue->count++] = triangle;
+	return true;
+}
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Declaration of the global transformation matrices
@@ -43,20 +69,28 @@ void setup(void) {
 	set_render_method(RENDER_WIRE);
 	set_cull_method(CULL_BACKFACE);
 
+	// Pick the fastest span kernel and vertex transform kernel supported by this CPU
+	init_span_kernels();
+	init_transform_kernels();
+
+	// Start the tile workers and rasterize on all cores when there is more than one
+	if (init_tile_renderer() && get_num_tile_workers() > 0) {
+		set_render_backend(RENDER_BACKEND_TILED);
+	}
+	else {
+		set_render_backend(RENDER_BACKEND_SERIAL);
+	}
+
 	// Initialize the scene light direction
 	init_light(vec3_new(0, 0, 1));
 
-	// Initialize the perspective projection matrix
-	float aspect_x = (float)get_window_width() / (float)get_window_height();
+	// Initialize the perspective projection matrix, which also defines the clip space view volume
 	float aspect_y = (float)get_window_height() / (float)get_window_width();
 	float fov_y = 3.141592 / 3.0; // Equal to 180/3, or M_PI/3, or 60 degrees
-	float fov_x = atan(tan(fov_y / 2) * aspect_x) * 2.0;
 	float z_near = 0.1;
 	float z_far = 100.0;
 	proj_matrix = mat4_make_perspective(fov_y, aspect_y, z_near, z_far);
-
-	// Initialize frustum planes with a point and a normal
-	init_frustum_planes(fov_x, fov_y, z_near, z_far);
+	set_depth_range(z_near, z_far);
 
 	/*
 	// Loads an .obj, .png, scale, translation, and rotation values into the mesh data structure
@@ -71,6 +105,26 @@ void setup(void) {
 	load_mesh("./assets/efa.obj", "./assets/efa.png", vec3_new(1, 1, 1), vec3_new(-2, -1.3, +9), vec3_new(0, -M_PI / 2, 0));
 	load_mesh("./assets/f117.obj", "./assets/f117.png", vec3_new(1, 1, 1), vec3_new(+2, -1.3, +9), vec3_new(0, -M_PI / 2, 0));
 	load_mesh("./assets/runway.obj", "./assets/runway.png", vec3_new(1, 1, 1), vec3_new(0, -1.5, +23), vec3_new(0, 0, 0));
+
+#ifdef TRANSFORM_BENCHMARK
+	// Times the vertex transform kernels on every mesh, then on a batch too large for the caches
+	for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
+		char benchmark_name[16];
+		snprintf(benchmark_name, sizeof(benchmark_name), "mesh %d", mesh_index);
+		benchmark_transform_kernels(benchmark_name, &get_mesh(mesh_index)->positions);
+	}
+	mesh_t* tiled_mesh = get_mesh(0);
+	int num_mesh_vertices = array_length(tiled_mesh->vertices);
+	int num_tiled_vertices = (1 << 20) / num_mesh_vertices * num_mesh_vertices;
+	vec3_t* tiled_vertices = (vec3_t*)malloc(sizeof(vec3_t) * num_tiled_vertices);
+	for (int i = 0; i < num_tiled_vertices; i++) {
+		tiled_vertices[i] = tiled_mesh->vertices[i % num_mesh_vertices];
+	}
+	vertex_positions_t tiled_positions = make_vertex_positions(tiled_vertices, num_tiled_vertices);
+	benchmark_transform_kernels("tiled mesh", &tiled_positions);
+	free_vertex_positions(&tiled_positions);
+	free(tiled_vertices);
+#endif
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -122,6 +176,46 @@ void process_input(void) {
 					set_cull_method(CULL_NONE);
 					break;
 				}
+				if (event.key.keysym.sym == SDLK_t) {						// "t": Rasterizes screen tiles on all cores
+					set_render_backend(RENDER_BACKEND_TILED);
+					break;
+				}
+				if (event.key.keysym.sym == SDLK_y) {						// "y": Rasterizes on the main thread only
+					set_render_backend(RENDER_BACKEND_SERIAL);
+					break;
+				}
+				if (event.key.keysym.sym == SDLK_e) {						// "e": Divides by w at every textured pixel
+					set_texture_quality(TEXTURE_QUALITY_EXACT);
+					break;
+				}
+				if (event.key.keysym.sym == SDLK_f) {						// "f": Divides by w only where the texel error stays under a texel
+					set_texture_quality(TEXTURE_QUALITY_FAST);
+					break;
+				}
+				if (event.key.keysym.sym == SDLK_g) {						// "g": Toggles leaving the side planes to the rasterizer inside a guard band
+					set_guard_band(!is_guard_band_enabled());
+					break;
+				}
+				if (event.key.keysym.sym == SDLK_l) {						// "l": Toggles storing the color buffer and z-buffer as 8x8 blocks
+					set_buffer_layout(is_buffer_layout_tiled() ? BUFFER_LAYOUT_LINEAR : BUFFER_LAYOUT_TILED);
+					break;
+				}
+				if (event.key.keysym.sym == SDLK_b) {						// "b": Cycles the z-buffer through 32-bit float, 24-bit, and 16-bit depth
+					set_depth_format((get_depth_format() + 1) % NUM_DEPTH_FORMATS);
+					break;
+				}
+				if (event.key.keysym.sym == SDLK_h) {						// "h": Toggles the depth test
+					set_depth_test(!is_depth_test_enabled());
+					break;
+				}
+				if (event.key.keysym.sym == SDLK_k) {						// "k": Cycles presenting through copying, the locked SDL texture, and a presenter thread
+					set_present_mode((get_present_mode() + 1) % NUM_PRESENT_MODES);
+					break;
+				}
+				if (event.key.keysym.sym == SDLK_p) {						// "p": Toggles printing the frame statistics every second
+					set_stats_output(!is_stats_output_enabled());
+					break;
+				}
 				if (event.key.keysym.sym == SDLK_1) {						// "1": Renders the mesh wireframe with vertices
 					set_render_method(RENDER_WIRE_VERTEX);
 					break;
@@ -154,37 +248,59 @@ void process_input(void) {
 					set_render_method(RENDER_TEXTURED_WIRE_VERTEX);
 					break;
 				}
+				if (event.key.keysym.sym == SDLK_9) {						// "9": Renders the mesh textured after a depth pre-pass
+					set_render_method(RENDER_TEXTURED_DEPTH_PREPASS);
+					break;
+				}
 			break;
 		}
 	}
 }
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Perspective divide and viewport transform of a clip space point
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+vec4_t project_to_screen(vec4_t point) {
+	// Perform perspective divide with original z-value that the projection stored in w
+	vec4_t projected_point = point;
+	projected_point.x /= projected_point.w;
+	projected_point.y /= projected_point.w;
+	projected_point.z /= projected_point.w;
+
+	// Scale projected points into view
+	projected_point.x *= (get_window_width() / 2.0);
+	projected_point.y *= (get_window_height() / 2.0);
+
+	// Invert the y values to account for flipped screen y-coordinate
+	projected_point.y *= -1;
+
+	// Center projected points on screen via translation
+	projected_point.x += (get_window_width() / 2.0);
+	projected_point.y += (get_window_height() / 2.0);
+
+	return projected_point;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Process the graphics pipeline stages for all the mesh triangles
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // +-------------+
 // | Model space |  <-- original mesh vertices
 // +-------------+
-// |   +-------------+
-// `-> | World space |  <-- multiply by world matrix
-//     +-------------+
-//     |   +--------------+
-//     `-> | Camera space |  <-- multiply by view matrix
-//         +--------------+
-//         |    +------------+
-//         `--> |  Clipping  |  <-- clip against the six frustum planes
-//              +------------+
-//              |    +------------+
-//              `--> | Projection |  <-- multiply by projection matrix
-//                   +------------+
-//                   |    +-------------+
-//                   `--> | Image space |  <-- apply perspective divide
-//                        +-------------+
-//                        |    +--------------+
-//                        `--> | Screen space |  <-- ready to render
-//                             +--------------+
+// |   +-------------------+
+// `-> | Clip space        |  <-- multiply each unique vertex once by the fused world, view, and projection matrix
+//     +-------------------+
+//     |   +------------+
+//     `-> |  Clipping  |  <-- clip against the near and far planes, and the side planes outside the guard band
+//         +------------+
+//         |    +-------------+
+//         `--> | Image space |  <-- apply perspective divide
+//              +-------------+
+//              |    +--------------+
+//              `--> | Screen space |  <-- ready to render
+//                   +--------------+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void process_graphics_pipeline_stages(mesh_t* mesh) {
+void transform_mesh_vertices(mesh_t* mesh) {
 	// Create scale, rotation, and translation matrices that will be used to multiply the mesh vertices
 	mat4_t scale_matrix = mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
 	mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
@@ -192,57 +308,75 @@ void process_graphics_pipeline_stages(mesh_t* mesh) {
 	mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
 	mat4_t translation_matrix = mat4_make_translation(mesh->translation.x, mesh->translation.y, mesh->translation.z);
 
+	// Create a World Matrix combining scale, rotation, and translation matrices
+	world_matrix = mat4_identity();
+
+	// Order matters!!! Transformations to the mesh are made with respect to the origin!!!
+	// Rotating then translating is NOT the same as translating then rotating!!!
+	world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
+	world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
+	world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
+	world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
+	world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
+
 	// Update camera look-at target and initialize the view matrix
 	vec3_t target = get_camera_lookat_target();
 	vec3_t up_direction = vec3_new(0, 1, 0);
 	view_matrix = mat4_look_at(get_camera_position(), target, up_direction);
 
-	// Loop through triangle faces of the mesh
-	int num_faces = array_length(mesh->faces);
-	for (int i = 0; i < num_faces; i++) {
+	// Fuse the world, view, and projection matrices so every vertex reaches clip space in a single multiplication
+	mat4_t world_view_proj_matrix = mat4_mul_mat4(proj_matrix, mat4_mul_mat4(view_matrix, world_matrix));
 
-		face_t mesh_face = mesh->faces[i];
-
-		vec3_t face_vertices[3];
-		face_vertices[0] = mesh->vertices[mesh_face.a];
-		face_vertices[1] = mesh->vertices[mesh_face.b];
-		face_vertices[2] = mesh->vertices[mesh_face.c];
-
-		vec4_t transformed_vertices[3];
-
-		// Loop all 3 vertices of the current face and apply transformations
-		for (int j = 0; j < 3; j++) {
-			vec4_t transformed_vertex = vec4_from_vec3(face_vertices[j]);
+	// Test the bounding sphere against the frustum, and the tighter bounding box only when the sphere straddles a plane
+	int bounds_classification = classify_bounding_sphere(world_view_proj_matrix, mesh->bounding_center, mesh->bounding_radius);
+	if (bounds_classification == CLIP_NEEDED) {
+		bounds_classification = classify_bounding_box(world_view_proj_matrix, mesh->bounds_min, mesh->bounds_max);
+	}
+	mesh->is_culled = bounds_classification == CLIP_TRIVIAL_REJECT;
+	mesh->is_inside_frustum = bounds_classification == CLIP_TRIVIAL_ACCEPT;
+	if (mesh->is_culled) {
+		add_stat(STAT_MESHES_CULLED, 1);
+		return;
+	}
+	if (mesh->is_inside_frustum) {
+		add_stat(STAT_MESHES_INSIDE_FRUSTUM, 1);
+	}
 
-			// Create a World Matrix combining scale, rotation, and translation matrices
-			world_matrix = mat4_identity();
+	// Transform every vertex once into the post-transform vertex cache, the faces only gather their three entries
+	transform_vertices(world_view_proj_matrix, proj_matrix, &mesh->positions, mesh->clip_vertices, mesh->camera_vertices, mesh->vertex_outcodes);
+	add_stat(STAT_VERTICES_TRANSFORMED, mesh->positions.count);
+}
 
-			// Order matters!!! Transformations to the mesh are made with respect to the origin!!!
-			// Rotating then translating is NOT the same as translating then rotating!!!
-			world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
-			world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
-			world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
-			world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
-			world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
+// Culls, clips, and projects a range of faces of a mesh, appending the triangles to render to the given queue
+void process_mesh_faces(mesh_t* mesh, int first_face, int end_face, triangle_queue_t* queue) {
+	int num_trivially_rejected = 0;
+	int num_trivially_accepted = 0;
+	int num_clipped = 0;
+	bool has_room = true;
 
-			// Multiply the World Matrix by the original vector
-			transformed_vertex = mat4_mul_vec4(world_matrix, transformed_vertex);
+	// Loop through triangle faces of the mesh, until the queue cannot grow anymore
+	for (int i = first_face; has_room && i < end_face; i++) {
+		mesh->is_face_visible[i] = false;
 
-			// Multiply the view matrix by the transformed vector to transform the scene to camera space
-			transformed_vertex = mat4_mul_vec4(view_matrix, transformed_vertex);
+		face_t mesh_face = mesh->faces[i];
+		int face_vertex_indices[3] = { mesh_face.a, mesh_face.b, mesh_face.c };
 
-			// Save transformed vertex in the array of transformed vertices
-			transformed_vertices[j] = transformed_vertex;
+		// Gather the transformed vertices of the face from the cache
+		vec4_t clip_vertices[3];
+		vec4_t camera_vertices[3];
+		for (int j = 0; j < 3; j++) {
+			clip_vertices[j] = mesh->clip_vertices[face_vertex_indices[j]];
+			camera_vertices[j] = mesh->camera_vertices[face_vertex_indices[j]];
 		}
 
 		// Calculate the triangle facing normal
-		vec3_t face_normal = get_triangle_normal(transformed_vertices);
+		vec3_t face_normal = get_triangle_normal(camera_vertices);
 
 		// Bypass triangles that are looking away from the camera (backfaces)
 		if (is_cull_backface()) {
 
 			// Find the vector between a point in the triangle and the camera origin
-			vec3_t camera_ray = vec3_sub(vec3_new(0, 0, 0), vec3_from_vec4(transformed_vertices[0]));
+			vec3_t camera_ray = vec3_sub(vec3_new(0, 0, 0), vec3_from_vec4(camera_vertices[0]));
 
 			// Calculate dot product of normal vector and camera ray, if it's less than zero, those faces are culled
 			float dot_normal_camera = vec3_dot(face_normal, camera_ray);
@@ -253,48 +387,70 @@ void process_graphics_pipeline_stages(mesh_t* mesh) {
 
 		// Clipping implementation ///////////////////////////////////////////////////////////////////////////////
 
-		// Create a polygon from the original transformed triangle to be clipped
-		polygon_t polygon = create_polygon_from_triangle(
-			vec3_from_vec4(transformed_vertices[0]),
-			vec3_from_vec4(transformed_vertices[1]),
-			vec3_from_vec4(transformed_vertices[2]),
-			mesh_face.a_uv,
-			mesh_face.b_uv,
-			mesh_face.c_uv
-		);
+		// Classify the vertices against the frustum planes to skip the polygon clipper whenever possible,
+		// every face of a mesh whose bounding volume needs no clipping is accepted without looking
+		int outcodes[3] = { 0, 0, 0 };
+		int classification = CLIP_TRIVIAL_ACCEPT;
+		if (!mesh->is_inside_frustum) {
+			for (int j = 0; j < 3; j++) {
+				outcodes[j] = mesh->vertex_outcodes[face_vertex_indices[j]];
+			}
+			classification = classify_triangle(outcodes[0], outcodes[1], outcodes[2]);
+		}
+
+		// Triangles entirely outside one plane are dropped without building a polygon
+		if (classification == CLIP_TRIVIAL_REJECT) {
+			num_trivially_rejected++;
+			continue;
+		}
 
-		// Clips the polygon and returns a new polygon
-		clip_polygon(&polygon);
+		// The overlays clip and draw the edges and vertices of the visible faces
+		mesh->is_face_visible[i] = true;
 
-		// Break the polygon into triangles after clipping
 		triangle_t triangles_after_clipping[MAX_NUM_POLY_TRIANGLES];
 		int num_triangles_after_clipping = 0;
 
-		triangles_from_polygon(&polygon, triangles_after_clipping, &num_triangles_after_clipping);
+		// Triangles entirely inside go straight to the perspective divide
+		if (classification == CLIP_TRIVIAL_ACCEPT) {
+			for (int j = 0; j < 3; j++) {
+				triangles_after_clipping[0].points[j] = clip_vertices[j];
+			}
+			triangles_after_clipping[0].texcoords[0] = mesh_face.a_uv;
+			triangles_after_clipping[0].texcoords[1] = mesh_face.b_uv;
+			triangles_after_clipping[0].texcoords[2] = mesh_face.c_uv;
+			num_triangles_after_clipping = 1;
+			num_trivially_accepted++;
+		}
+		else {
+			// Create a polygon from the original transformed triangle to be clipped
+			polygon_t polygon = create_polygon_from_triangle(
+				clip_vertices[0],
+				clip_vertices[1],
+				clip_vertices[2],
+				mesh_face.a_uv,
+				mesh_face.b_uv,
+				mesh_face.c_uv
+			);
+
+			// Clips the polygon against the planes its vertices are outside of and returns a new polygon
+			clip_polygon(&polygon, outcodes[0] | outcodes[1] | outcodes[2]);
+
+			// Break the polygon into triangles after clipping
+			triangles_from_polygon(&polygon, triangles_after_clipping, &num_triangles_after_clipping);
+			num_clipped++;
+		}
 
 		//////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 		// Loops through the assembled triangles after clipping
-		for (int t = 0; t < num_triangles_after_clipping; t++) {
+		for (int t = 0; has_room && t < num_triangles_after_clipping; t++) {
 			triangle_t triangle_after_clipping = triangles_after_clipping[t];
 
 			vec4_t projected_points[3];
 
-			// Loop all 3 vertices and project transformed faces onto the display
+			// Loop all 3 vertices and project clipped faces onto the display
 			for (int j = 0; j < 3; j++) {
-				// Project the current vertex
-				projected_points[j] = mat4_mul_vec4_project(proj_matrix, triangle_after_clipping.points[j]);
-
-				// Scale projected points into view
-				projected_points[j].x *= (get_window_width() / 2.0);
-				projected_points[j].y *= (get_window_height() / 2.0);
-
-				// Invert the y values to account for flipped screen y-coordinate
-				projected_points[j].y *= -1;
-
-				// Center projected points on screen via translation
-				projected_points[j].x += (get_window_width() / 2.0);
-				projected_points[j].y += (get_window_height() / 2.0);
+				projected_points[j] = project_to_screen(triangle_after_clipping.points[j]);
 			}
 
 			// Calculate the light intensity based on face normal alignment with the inverse of the light ray
@@ -318,10 +474,117 @@ void process_graphics_pipeline_stages(mesh_t* mesh) {
 				.texture = mesh->texture
 			};
 
-			// Save the projected triangle in the array of triangles to render
-			if (num_triangles_to_render < MAX_TRIANGLES) {
-				triangles_to_render[num_triangles_to_render++] = triangle_to_render;
+			// Save the projected triangle in the queue of the face range
+			has_room = push_triangle(queue, triangle_to_render);
+		}
+	}
+
+	add_stat(STAT_TRIANGLES_TRIVIALLY_REJECTED, num_trivially_rejected);
+	add_stat(STAT_TRIANGLES_TRIVIALLY_ACCEPTED, num_trivially_accepted);
+	add_stat(STAT_TRIANGLES_CLIPPED, num_clipped);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Geometry stage on all cores
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The vertices of every mesh are transformed up front, then the faces are cut
+// into chunks of GEOMETRY_CHUNK_FACES that the tile workers and the main
+// thread take from a shared counter. Each chunk appends its triangles to its
+// own queue, and the renderers walk the queues in chunk order, so the
+// triangles are drawn in the same order as from a single thread without
+// being copied into one array first. The overlays only need to know which
+// faces were visible, and mark their edges and vertices once all chunks are
+// done.
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#define GEOMETRY_CHUNK_FACES 64
+
+typedef struct {
+	mesh_t* mesh;
+	int first_face;
+	int end_face;
+} geometry_chunk_t;
+
+geometry_chunk_t* geometry_chunks = NULL;
+int num_geometry_chunks = 0;
+SDL_atomic_t next_geometry_chunk;
+
+void process_geometry_chunks(void) {
+	int chunk;
+	while ((chunk = SDL_AtomicAdd(&next_geometry_chunk, 1)) < num_geometry_chunks) {
+		geometry_chunk_t* geometry_chunk = &geometry_chunks[chunk];
+		triangle_queues[chunk].count = 0;
+		process_mesh_faces(geometry_chunk->mesh, geometry_chunk->first_face, geometry_chunk->end_face, &triangle_queues[chunk]);
+	}
+}
+
+void mark_visible_overlay_elements(mesh_t* mesh) {
+	memset(mesh->is_edge_visible, 0, sizeof(bool) * array_length(mesh->edges));
+	memset(mesh->is_vertex_visible, 0, sizeof(bool) * array_length(mesh->vertices));
+	if (mesh->is_culled) {
+		return;
+	}
+	int num_faces = array_length(mesh->faces);
+	for (int i = 0; i < num_faces; i++) {
+		if (!mesh->is_face_visible[i]) {
+			continue;
+		}
+		int face_vertex_indices[3] = { mesh->faces[i].a, mesh->faces[i].b, mesh->faces[i].c };
+		for (int j = 0; j < 3; j++) {
+			mesh->is_vertex_visible[face_vertex_indices[j]] = true;
+			mesh->is_edge_visible[mesh->face_edges[i * 3 + j]] = true;
+		}
+	}
+}
+
+void process_graphics_pipeline_stages(void) {
+	// Cut the faces of every mesh into chunks, reusing the triangle queues of the last frame
+	num_geometry_chunks = 0;
+	for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
+		mesh_t* mesh = get_mesh(mesh_index);
+		transform_mesh_vertices(mesh);
+		if (mesh->is_culled) {
+			continue;
+		}
+
+		int num_faces = array_length(mesh->faces);
+		for (int first_face = 0; first_face < num_faces; first_face += GEOMETRY_CHUNK_FACES) {
+			if (num_geometry_chunks == array_length(geometry_chunks)) {
+				geometry_chunk_t new_chunk = { 0 };
+				triangle_queue_t new_queue = { 0 };
+				array_push(geometry_chunks, new_chunk);
+				array_push(triangle_queues, new_queue);
 			}
+			geometry_chunk_t* geometry_chunk = &geometry_chunks[num_geometry_chunks++];
+			geometry_chunk->mesh = mesh;
+			geometry_chunk->first_face = first_face;
+			geometry_chunk->end_face = first_face + GEOMETRY_CHUNK_FACES < num_faces ? first_face + GEOMETRY_CHUNK_FACES : num_faces;
+		}
+	}
+
+	// The tiled backend runs the chunks on all cores, the serial backend on the main thread only
+	SDL_AtomicSet(&next_geometry_chunk, 0);
+	if (is_render_backend_tiled()) {
+		run_on_tile_workers(process_geometry_chunks);
+	}
+	else {
+		process_geometry_chunks();
+	}
+
+	// The queues of the chunks together hold the triangles to render of the frame
+	int queue_capacity = 0;
+	for (int chunk = 0; chunk < num_geometry_chunks; chunk++) {
+		num_triangles_to_render += triangle_queues[chunk].count;
+		queue_capacity += triangle_queues[chunk].capacity;
+	}
+	if (num_triangles_to_render > peak_triangles_to_render) {
+		peak_triangles_to_render = num_triangles_to_render;
+	}
+	add_stat(STAT_TRIANGLE_QUEUE_PEAK, peak_triangles_to_render);
+	add_stat(STAT_TRIANGLE_QUEUE_CAPACITY, queue_capacity);
+
+	if (should_render_wireframe() || should_render_vertices()) {
+		for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
+			mark_visible_overlay_elements(get_mesh(mesh_index));
 		}
 	}
 }
@@ -350,31 +613,49 @@ void update(void) {
 
 	previous_frame_time = SDL_GetTicks();
 
-	// Initialize the counter of triangles to render for the current frame
+	// Initialize the counter of triangles to render and the statistics for the current frame
 	num_triangles_to_render = 0;
+	begin_stats_frame();
 
-	// Loop all the meshes of the scene from the array of meshes
-	for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
-		mesh_t* mesh = get_mesh(mesh_index);
+	process_graphics_pipeline_stages();
+}
 
-		// Change the mesh scale, rotation, and translation values per second /////////////////////////////////////
-		// For non-incremental manipulations, remove "* delta_time" from the chosen line //////////////////////////
-		/*
-		mesh.scale.x += 0.0 * delta_time;			// Increments mesh x-scale by 0.0 units each second
-		mesh.scale.y += 0.0 * delta_time;			// Increments mesh y-scale by 0.0 units each second
-		mesh.scale.z += 0.0 * delta_time;			// Increments mesh z-scale by 0.0 units each second
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Overlays drawn from the unique edges and vertices of a mesh
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void draw_mesh_wireframe(mesh_t* mesh, uint32_t color) {
+	int num_edges = array_length(mesh->edges);
+	for (int i = 0; i < num_edges; i++) {
+		if (!mesh->is_edge_visible[i]) {
+			continue;
+		}
 
-		mesh.rotation.x += 0.0 * delta_time;		// Increments mesh x-rotation by 0.0 units each second
-		mesh.rotation.y += 0.0 * delta_time;		// Increments mesh y-rotation by 0.0 units each second
-		mesh.rotation.z += 0.0 * delta_time;		// Increments mesh z-rotation by 0.0 units each second
+		// Clip the edge in clip space so edges crossing the near plane still end at the right screen point
+		vec4_t a = mesh->clip_vertices[mesh->edges[i].a];
+		vec4_t b = mesh->clip_vertices[mesh->edges[i].b];
+		if (!clip_line(&a, &b)) {
+			continue;
+		}
+		a = project_to_screen(a);
+		b = project_to_screen(b);
+		draw_line(a.x, a.y, b.x, b.y, color);
+	}
+}
 
-		mesh.translation.x += 0.0 * delta_time;		// Increments mesh x-translation by 0.0 units each second
-		mesh.translation.y += 0.0 * delta_time;		// Increments mesh y-translation by 0.0 units each second
-		mesh.translation.z += 0.0 * delta_time;		// Increments mesh z-translation by 0.0 units each second
-		*/
-		///////////////////////////////////////////////////////////////////////////////////////////////////////////
+void draw_mesh_vertices(mesh_t* mesh, uint32_t color) {
+	int num_vertices = array_length(mesh->vertices);
+	for (int i = 0; i < num_vertices; i++) {
+		if (!mesh->is_vertex_visible[i]) {
+			continue;
+		}
 
-		process_graphics_pipeline_stages(mesh);
+		// Only vertices between the near and far planes and inside the guard band have a marker that can reach the screen
+		vec4_t vertex = mesh->clip_vertices[i];
+		if (compute_outcode(vertex) & (FRUSTUM_OUTCODE(NEAR_FRUSTUM_PLANE) | FRUSTUM_OUTCODE(FAR_FRUSTUM_PLANE) | GUARD_BAND_OUTCODE_MASK)) {
+			continue;
+		}
+		vertex = project_to_screen(vertex);
+		draw_rect(vertex.x - 3, vertex.y - 3, 6, 6, color);
 	}
 }
 
@@ -387,61 +668,202 @@ void render(void) {
 	clear_z_buffer();
 	draw_grid();
 
-	// Loop all projected tris and render them
-	for (int i = 0; i < num_triangles_to_render; i++) {
-		triangle_t triangle = triangles_to_render[i];
-
-		// Filled faces
-		if (should_render_filled_triangles()) {
-			// Draw filled tris
-			draw_filled_triangle(
-				triangle.points[0].x, triangle.points[0].y, triangle.points[0].z, triangle.points[0].w, // Vertex A
-				triangle.points[1].x, triangle.points[1].y, triangle.points[1].z, triangle.points[1].w, // Vertex B
-				triangle.points[2].x, triangle.points[2].y, triangle.points[2].z, triangle.points[2].w, // Vertex C
-				triangle.color // White faces
-			);
+	// Resolve the render state once for the whole frame instead of once per triangle
+	resolve_span_shaders();
+	bool is_rasterized_serially = !is_render_backend_tiled();
+	bool is_filled = should_render_filled_triangles();
+	bool is_textured = should_render_textured_triangles();
+	bool is_wireframe = should_render_wireframe();
+	bool is_vertices = should_render_vertices();
+
+	// With the tiled backend the tile workers draw all filled and textured faces up front
+	if (!is_rasterized_serially && (is_filled || is_textured)) {
+		render_tiles(triangle_queues, num_geometry_chunks);
+	}
+
+	// Depth pre-pass: the z-buffer gets the nearest depth of every pixel before any texel is fetched
+	if (is_rasterized_serially && should_render_depth_prepass()) {
+		screen_rect_t screen_rect = { 0, 0, get_window_width() - 1, get_window_height() - 1 };
+		for (int chunk = 0; chunk < num_geometry_chunks; chunk++) {
+			for (int i = 0; i < triangle_queues[chunk].count; i++) {
+				draw_triangle_depth_in_rect(&triangle_queues[chunk].triangles[i], screen_rect);
+			}
 		}
+	}
 
-		// Textured faces
-		if (should_render_textured_triangles()) {
-			// Draw textured tris
-			draw_textured_triangle(
-				triangle.points[0].x, triangle.points[0].y, triangle.points[0].z, triangle.points[0].w, triangle.texcoords[0].u, triangle.texcoords[0].v, // Vertex A
-				triangle.points[1].x, triangle.points[1].y, triangle.points[1].z, triangle.points[1].w, triangle.texcoords[1].u, triangle.texcoords[1].v, // Vertex B
-				triangle.points[2].x, triangle.points[2].y, triangle.points[2].z, triangle.points[2].w, triangle.texcoords[2].u, triangle.texcoords[2].v, // Vertex C
-				triangle.texture // Textured faces
-			);
+	// Loop all projected tris and render them
+	for (int chunk = 0; is_rasterized_serially && chunk < num_geometry_chunks; chunk++) {
+		for (int i = 0; i < triangle_queues[chunk].count; i++) {
+			triangle_t triangle = triangle_queues[chunk].triangles[i];
+
+			// Filled faces
+			if (is_filled) {
+				// Draw filled tris
+				draw_filled_triangle(
+					triangle.points[0].x, triangle.points[0].y, triangle.points[0].z, triangle.points[0].w, // Vertex A
+					triangle.points[1].x, triangle.points[1].y, triangle.points[1].z, triangle.points[1].w, // Vertex B
+					triangle.points[2].x, triangle.points[2].y, triangle.points[2].z, triangle.points[2].w, // Vertex C
+					triangle.color // White faces
+				);
+			}
+
+			// Textured faces
+			if (is_textured) {
+				// Draw textured tris
+				draw_textured_triangle(
+					triangle.points[0].x, triangle.points[0].y, triangle.points[0].z, triangle.points[0].w, triangle.texcoords[0].u, triangle.texcoords[0].v, // Vertex A
+					triangle.points[1].x, triangle.points[1].y, triangle.points[1].z, triangle.points[1].w, triangle.texcoords[1].u, triangle.texcoords[1].v, // Vertex B
+					triangle.points[2].x, triangle.points[2].y, triangle.points[2].z, triangle.points[2].w, triangle.texcoords[2].u, triangle.texcoords[2].v, // Vertex C
+					triangle.texture // Textured faces
+				);
+			}
 		}
+	}
+
+	// Overlays draw every unique edge and vertex once, on top of the faces
+	for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
+		mesh_t* mesh = get_mesh(mesh_index);
 
 		// Wireframe
-		if (should_render_wireframe()) {
-			// Draw edges of tris (wireframe)
-			draw_triangle(
-				triangle.points[0].x, triangle.points[0].y, // Vertex A
-				triangle.points[1].x, triangle.points[1].y, // Vertex B
-				triangle.points[2].x, triangle.points[2].y, // Vertex C
-				0xFFFFFFFF // White edges
-			);
+		if (is_wireframe) {
+			draw_mesh_wireframe(mesh, 0xFFFFFFFF); // White edges
 		}
 
 		// Vertices
-		if (should_render_vertices()) {
-			// Draw verteces of tris
-			draw_rect(triangle.points[0].x - 3, triangle.points[0].y - 3, 6, 6, 0xFF008FFF); // Vertex A
-			draw_rect(triangle.points[1].x - 3, triangle.points[1].y - 3, 6, 6, 0xFF008FFF); // Vertex B
-			draw_rect(triangle.points[2].x - 3, triangle.points[2].y - 3, 6, 6, 0xFF008FFF); // Vertex C
-			// Orange vertices
+		if (is_vertices) {
+			draw_mesh_vertices(mesh, 0xFF008FFF); // Orange vertices
 		}
 	}
 
 	// Draw the color buffer to the SDL window
 	render_color_buffer();
+
+	// Report the counters of the frame that was just drawn
+	end_stats_frame();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Span kernel check, run with --check-span-kernels instead of the main loop
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The vector kernels promise the exact pixels and depths of the scalar kernel. Every bundled mesh is loaded
+// on its own and its textured faces are drawn serially with every kernel the CPU supports, in every depth
+// format and buffer layout, with the depth test, after the depth pre-pass and without the depth test, and
+// the buffers are compared with the scalar ones.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+static uint64_t hash_bytes(uint64_t hash, const void* bytes, size_t size) {
+	const uint8_t* data = bytes;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * 0x100000001B3ull;
+	}
+	return hash;
+}
+
+// Draws the textured faces with the current state and returns a hash of the color buffer and the z-buffer
+static uint64_t draw_span_kernel_check_frame(void) {
+	int num_pixels = get_window_width() * get_window_height();
+	size_t depth_size = get_depth_format() == DEPTH_FORMAT_UNORM16 ? sizeof(uint16_t) : sizeof(uint32_t);
+
+	// Whether the clears are lazy or eager, the same bytes end up in pixels no kernel writes
+	clear_color_buffer(0xFF000000);
+	clear_z_buffer();
+	memset(get_color_buffer(), 0x5A, sizeof(uint32_t) * num_pixels);
+	memset(get_z_buffer(), 0x7F, depth_size * num_pixels);
+
+	resolve_span_shaders();
+	screen_rect_t screen_rect = { 0, 0, get_window_width() - 1, get_window_height() - 1 };
+	if (should_render_depth_prepass()) {
+		for (int chunk = 0; chunk < num_geometry_chunks; chunk++) {
+			for (int i = 0; i < triangle_queues[chunk].count; i++) {
+				draw_triangle_depth_in_rect(&triangle_queues[chunk].triangles[i], screen_rect);
+			}
+		}
+	}
+	for (int chunk = 0; chunk < num_geometry_chunks; chunk++) {
+		for (int i = 0; i < triangle_queues[chunk].count; i++) {
+			draw_textured_triangle_in_rect(&triangle_queues[chunk].triangles[i], screen_rect);
+		}
+	}
+
+	uint64_t hash = hash_bytes(0xCBF29CE484222325ull, get_color_buffer(), sizeof(uint32_t) * num_pixels);
+	return hash_bytes(hash, get_z_buffer(), depth_size * num_pixels);
+}
+
+// Draws the mesh that is loaded with every kernel in every state, returns false when a kernel differs from the scalar one
+static bool check_span_kernels_on_mesh(const char* mesh_name) {
+	static const char* kernel_names[] = { "scalar", "SSE2", "AVX2" };
+	static const struct {
+		int render_method;
+		bool is_depth_tested;
+	} render_states[] = {
+		{ RENDER_TEXTURED, true },
+		{ RENDER_TEXTURED_DEPTH_PREPASS, true },
+		{ RENDER_TEXTURED, false }
+	};
+
+	num_triangles_to_render = 0;
+	process_graphics_pipeline_stages();
+
+	bool are_kernels_exact = true;
+	for (int state = 0; state < (int)(sizeof(render_states) / sizeof(render_states[0])); state++) {
+		for (int format = 0; format < NUM_DEPTH_FORMATS; format++) {
+			for (int layout = BUFFER_LAYOUT_LINEAR; layout <= BUFFER_LAYOUT_TILED; layout++) {
+				set_render_method(render_states[state].render_method);
+				set_depth_test(render_states[state].is_depth_tested);
+				set_depth_format(format);
+				set_buffer_layout(layout);
+				set_span_kernel(SPAN_KERNEL_SCALAR);
+				uint64_t scalar_hash = draw_span_kernel_check_frame();
+
+				for (int kernel = SPAN_KERNEL_SSE2; kernel <= SPAN_KERNEL_AVX2; kernel++) {
+					if (set_span_kernel(kernel) && draw_span_kernel_check_frame() != scalar_hash) {
+						fprintf(stderr, "Error: the %s span kernel differs from the scalar kernel on %s (render method %d, depth test %d, depth format %d, layout %d).\n",
+							kernel_names[kernel], mesh_name, render_states[state].render_method, render_states[state].is_depth_tested, format, layout);
+						are_kernels_exact = false;
+					}
+				}
+			}
+		}
+	}
+	return are_kernels_exact;
+}
+
+// Replaces the scene with one bundled mesh at a time, so it must run instead of the main loop
+bool check_span_kernels(void) {
+	static const char* mesh_names[] = { "f22", "efa", "f117", "runway" };
+
+	bool are_kernels_exact = true;
+	for (int i = 0; i < (int)(sizeof(mesh_names) / sizeof(mesh_names[0])); i++) {
+		char obj_filename[64];
+		char png_filename[64];
+		snprintf(obj_filename, sizeof(obj_filename), "./assets/%s.obj", mesh_names[i]);
+		snprintf(png_filename, sizeof(png_filename), "./assets/%s.png", mesh_names[i]);
+
+		// The aircraft are checked where the f22 of the scene is, the runway where it lies in the scene
+		free_meshes();
+		if (strcmp(mesh_names[i], "runway") == 0) {
+			load_mesh(obj_filename, png_filename, vec3_new(1, 1, 1), vec3_new(0, -1.5, +23), vec3_new(0, 0, 0));
+		}
+		else {
+			load_mesh(obj_filename, png_filename, vec3_new(1, 1, 1), vec3_new(0, -1.3, +5), vec3_new(0, -M_PI / 2, 0));
+		}
+
+		bool is_mesh_exact = check_span_kernels_on_mesh(mesh_names[i]);
+		printf("Span kernels on %s: %s\n", mesh_names[i], is_mesh_exact ? "identical to the scalar kernel" : "DIFFERENT");
+		are_kernels_exact = are_kernels_exact && is_mesh_exact;
+	}
+	return are_kernels_exact;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Function to free the memory that was dynamically allocated by the program
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void free_resources(void) {
+	for (int chunk = 0; chunk < array_length(triangle_queues); chunk++) {
+		free(triangle_queues[chunk].triangles);
+	}
+	array_free(triangle_queues);
+	array_free(geometry_chunks);
+	destroy_tile_renderer();
 	free_meshes();
 	destroy_window();
 }
@@ -449,11 +871,18 @@ void free_resources(void) {
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Main loop
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-int main(void) {
+int main(int argc, char* argv[]) {
 	is_running = initialize_window();
 
 	setup();
 
+	// Exits with a non-zero status when a vector span kernel no longer draws exactly like the scalar kernel
+	if (argc > 1 && strcmp(argv[1], "--check-span-kernels") == 0) {
+		bool are_kernels_exact = is_running && check_span_kernels();
+		free_resources();
+		return are_kernels_exact ? 0 : 1;
+	}
+
 	while (is_running) {
 		process_input();
 		update();
@@ -1,6 +1,15 @@
 #include <math.h>
 #include "matrix.h"
 
+// mat4_mul_vec4 is the scalar reference of the batch vertex transform, so it must not fuse a * b + c into one FMA either
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#elif defined(_MSC_VER)
+#pragma fp_contract(off)
+#endif
+
 vec4_t mat4_mul_vec4(mat4_t m, vec4_t v) {
 	vec4_t result;
 	result.x = m.m[0][0] * v.x + m.m[0][1] * v.y + m.m[0][2] * v.z + m.m[0][3] * v.w;
@@ -130,6 +139,18 @@ vec4_t mat4_mul_vec4_project(mat4_t mat_proj, vec4_t v) {
 	return result;
 }
 
+vec4_t mat4_unproject_perspective(mat4_t mat_proj, vec4_t v) {
+	// Recover the view space point of a clip space point, which only works for matrices from mat4_make_perspective
+	// where x and y are scaled, and the original z-value is stored in w
+	vec4_t result = {
+		.x = v.x / mat_proj.m[0][0],
+		.y = v.y / mat_proj.m[1][1],
+		.z = v.w,
+		.w = 1.0
+	};
+	return result;
+}
+
 mat4_t mat4_look_at(vec3_t eye, vec3_t target, vec3_t up) {
 	// Compute the forward vector (z), right vector (x), and up vector (y)
 	vec3_t z = vec3_sub(target, eye);
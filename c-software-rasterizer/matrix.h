@@ -17,6 +17,7 @@ mat4_t mat4_make_rotation_z(float angle);
 mat4_t mat4_make_translation(float tx, float ty, float tz);
 mat4_t mat4_make_perspective(float fov, float aspect, float znear, float zfar);
 vec4_t mat4_mul_vec4_project(mat4_t mat_proj, vec4_t v);
+vec4_t mat4_unproject_perspective(mat4_t mat_proj, vec4_t v);
 mat4_t mat4_look_at(vec3_t eye, vec3_t target, vec3_t up);
 
 #endif
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "array.h"
 #include "mesh.h"
@@ -70,6 +71,91 @@ void load_mesh_obj_data(mesh_t* mesh, char* obj_filename) {
 	}
 	array_free(texcoords);
 	fclose(file);
+
+	load_mesh_bounds(mesh);
+	load_mesh_adjacency(mesh);
+	load_mesh_vertex_caches(mesh);
+}
+
+// Computes the bounding box of the vertices and the bounding sphere around the center of the box
+void load_mesh_bounds(mesh_t* mesh) {
+	int num_vertices = array_length(mesh->vertices);
+	mesh->bounds_min = num_vertices > 0 ? mesh->vertices[0] : vec3_new(0, 0, 0);
+	mesh->bounds_max = mesh->bounds_min;
+	for (int i = 1; i < num_vertices; i++) {
+		vec3_t vertex = mesh->vertices[i];
+		if (vertex.x < mesh->bounds_min.x) mesh->bounds_min.x = vertex.x;
+		if (vertex.y < mesh->bounds_min.y) mesh->bounds_min.y = vertex.y;
+		if (vertex.z < mesh->bounds_min.z) mesh->bounds_min.z = vertex.z;
+		if (vertex.x > mesh->bounds_max.x) mesh->bounds_max.x = vertex.x;
+		if (vertex.y > mesh->bounds_max.y) mesh->bounds_max.y = vertex.y;
+		if (vertex.z > mesh->bounds_max.z) mesh->bounds_max.z = vertex.z;
+	}
+
+	mesh->bounding_center = vec3_mul(vec3_add(mesh->bounds_min, mesh->bounds_max), 0.5f);
+	mesh->bounding_radius = 0;
+	for (int i = 0; i < num_vertices; i++) {
+		float distance = vec3_length(vec3_sub(mesh->vertices[i], mesh->bounding_center));
+		if (distance > mesh->bounding_radius) {
+			mesh->bounding_radius = distance;
+		}
+	}
+}
+
+// Edge of a face with its vertex indices in ascending order, so both faces sharing the edge produce the same key
+typedef struct {
+	int a;
+	int b;
+	int face_edge;	// Index into face_edges of the face that produced the key
+} edge_key_t;
+
+static int compare_edge_keys(const void* first, const void* second) {
+	const edge_key_t* key0 = first;
+	const edge_key_t* key1 = second;
+	if (key0->a != key1->a) return key0->a < key1->a ? -1 : 1;
+	if (key0->b != key1->b) return key0->b < key1->b ? -1 : 1;
+	return 0;
+}
+
+// Builds the unique edges of the mesh and the three edges of every face
+void load_mesh_adjacency(mesh_t* mesh) {
+	int num_faces = array_length(mesh->faces);
+
+	// Sorting the edges of every face brings the copies of a shared edge next to each other
+	edge_key_t* keys = (edge_key_t*)malloc(sizeof(edge_key_t) * num_faces * 3);
+	for (int i = 0; i < num_faces; i++) {
+		int corners[3] = { mesh->faces[i].a, mesh->faces[i].b, mesh->faces[i].c };
+		for (int j = 0; j < 3; j++) {
+			int a = corners[j];
+			int b = corners[(j + 1) % 3];
+			keys[i * 3 + j] = (edge_key_t){ a < b ? a : b, a < b ? b : a, i * 3 + j };
+		}
+	}
+	qsort(keys, num_faces * 3, sizeof(edge_key_t), compare_edge_keys);
+
+	mesh->face_edges = (int*)malloc(sizeof(int) * num_faces * 3);
+	for (int i = 0; i < num_faces * 3; i++) {
+		if (i == 0 || compare_edge_keys(&keys[i - 1], &keys[i]) != 0) {
+			mesh_edge_t edge = { keys[i].a, keys[i].b };
+			array_push(mesh->edges, edge);
+		}
+		mesh->face_edges[keys[i].face_edge] = array_length(mesh->edges) - 1;
+	}
+	free(keys);
+}
+
+// Allocates the buffers the pipeline fills every frame: the batch transform input, the post-transform vertex cache,
+// and the visibility of the faces, edges, and vertices for the overlays
+void load_mesh_vertex_caches(mesh_t* mesh) {
+	int num_faces = array_length(mesh->faces);
+	int num_vertices = array_length(mesh->vertices);
+	mesh->positions = make_vertex_positions(mesh->vertices, num_vertices);
+	mesh->clip_vertices = (vec4_t*)malloc(sizeof(vec4_t) * num_vertices);
+	mesh->camera_vertices = (vec4_t*)malloc(sizeof(vec4_t) * num_vertices);
+	mesh->vertex_outcodes = (int*)malloc(sizeof(int) * num_vertices);
+	mesh->is_face_visible = (bool*)calloc(num_faces, sizeof(bool));
+	mesh->is_edge_visible = (bool*)calloc(array_length(mesh->edges), sizeof(bool));
+	mesh->is_vertex_visible = (bool*)calloc(num_vertices, sizeof(bool));
 }
 
 // Loads .png texture for the mesh
@@ -96,5 +182,16 @@ void free_meshes(void) {
 		upng_free(meshes[i].texture);
 		array_free(meshes[i].faces);
 		array_free(meshes[i].vertices);
+		array_free(meshes[i].edges);
+		free(meshes[i].face_edges);
+		free_vertex_positions(&meshes[i].positions);
+		free(meshes[i].clip_vertices);
+		free(meshes[i].camera_vertices);
+		free(meshes[i].vertex_outcodes);
+		free(meshes[i].is_face_visible);
+		free(meshes[i].is_edge_visible);
+		free(meshes[i].is_vertex_visible);
+		meshes[i] = (mesh_t){ 0 };
 	}
+	mesh_count = 0;
 }
\ No newline at end of file
@@ -1,24 +1,55 @@
 #ifndef MESH_H
 #define MESH_H
 
+#include <stdbool.h>
 #include "vector.h"
 #include "triangle.h"
+#include "transform.h"
 #include "upng.h"
 
+// Declares a type for an edge between two mesh vertices, stored once no matter how many faces share it
+typedef struct {
+	int a;
+	int b;
+} mesh_edge_t;
+
 // Defines a struct for dynamically sized meshes with an array of vertices and faces
 typedef struct {
 	vec3_t* vertices;	// Mesh's dynamic array of vertices
+	vertex_positions_t positions;	// Copy of the vertices as one array per coordinate, for the batch transform
 	face_t* faces;		// Mesh's dynamic array of faces
+	mesh_edge_t* edges;	// Mesh's dynamic array of unique edges
+	int* face_edges;	// Three indices into the unique edges for every face (ab, bc, and ca)
 	upng_t* texture;	// Mesh's PNG texture pointer
 	vec3_t rotation;	// Mesh rotation with x, y, and z values
 	vec3_t scale;		// Mesh scale with x, y, and z values
 	vec3_t translation; // Mesh translation with x, y, and z values
 
+	// Model space bounding volumes, tested against the frustum before any vertex of the mesh is transformed
+	vec3_t bounds_min;			// Corner of the axis-aligned bounding box with the smallest coordinates
+	vec3_t bounds_max;			// Corner of the axis-aligned bounding box with the largest coordinates
+	vec3_t bounding_center;		// Center of the bounding sphere, which is the center of the box
+	float bounding_radius;		// Distance from the center to the farthest vertex
+	bool is_culled;				// The bounding volume is outside the frustum this frame
+	bool is_inside_frustum;		// The bounding volume needs no clipping this frame
+
+	// Post-transform vertex cache, filled once per frame so faces sharing a vertex do not transform it again
+	vec4_t* clip_vertices;		// Clip space position of every vertex
+	vec4_t* camera_vertices;	// Camera space position of every vertex, for the face normals
+	int* vertex_outcodes;		// Frustum outcode of every clip space position
+
+	// Per-frame state of the wireframe and vertex overlays
+	bool* is_face_visible;		// Faces that were neither culled nor rejected
+	bool* is_edge_visible;		// Edges of at least one visible face
+	bool* is_vertex_visible;	// Vertices of at least one visible face
 } mesh_t;
 
 void load_mesh(char* obj_filename, char* png_filename, vec3_t scale, vec3_t translation, vec3_t rotation);
 void load_mesh_obj_data(mesh_t* mesh, char* obj_filename);
 void load_mesh_png_data(mesh_t* mesh, char* png_filename);
+void load_mesh_bounds(mesh_t* mesh);
+void load_mesh_adjacency(mesh_t* mesh);
+void load_mesh_vertex_caches(mesh_t* mesh);
 int get_num_meshes(void);
 mesh_t* get_mesh(int index);
 void free_meshes(void);
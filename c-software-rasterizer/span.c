@@ -0,0 +1,771 @@
+#include <stdlib.h>
+#include <math.h>
+#include <SDL.h>
+#include "display.h"
+#include "span.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Span kernels for the inner loop of the rasterizer
+///////////////////////////////////////////////////////////////////////////////
+// The textured kernel comes in three flavors that produce identical pixels:
+// a scalar reference, an SSE2 version that shades 4 pixels per instruction,
+// and an AVX2 version that shades all 8 pixels of a block row at once. The
+// fastest kernel supported by the CPU is picked at runtime, so the same
+// binary runs on any x86-64 machine.
+//
+// To stay bit-exact with the scalar reference, the vector kernels evaluate
+// every attribute as start + step * i (never by accumulation), use a real
+// division for 1/w, and do the texture wrapping with exact float integers.
+//
+// With the equal depth test of the depth pre-pass, two triangles sharing an
+// edge can both have exactly the stored depth on it. The first one to shade
+// the pixel stores SHADED_DEPTH, which equals nothing, so each pixel is
+// shaded once and by the same triangle that wins the less-than test.
+//
+// Every kernel is written once as a FORCE_INLINE function taking the render
+// state (depth test, texture interpolation) as plain arguments. The DEFINE_
+// macros stamp out one function per combination with constant arguments, so
+// the compiler removes the state branches from each specialized kernel.
+// resolve_span_shaders() fills the kernel table once per frame.
+///////////////////////////////////////////////////////////////////////////////
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SPAN_HAS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+#if defined(_MSC_VER)
+#define FORCE_INLINE static __forceinline
+#else
+#define FORCE_INLINE static inline __attribute__((always_inline))
+#endif
+
+// Bit-exact kernels need every multiply and add rounded on its own. Builds with FMA enabled
+// (-march=native, -ffp-contract=fast) would otherwise fuse a * b + c in the scalar reference only
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#elif defined(_MSC_VER)
+#pragma fp_contract(off)
+#endif
+
+#define SPAN_WIDTH 8
+
+// Texture coordinates and texel indices stay exact as floats below this bound
+#define EXACT_FLOAT_INTEGER_LIMIT 8388608.0f
+#define EXACT_TEXEL_INDEX_LIMIT 16777216
+
+#define SHADED_DEPTH NAN
+#define SHADED_INTEGER_DEPTH 0
+
+static int span_kernel = SPAN_KERNEL_SCALAR;
+static int texture_quality = TEXTURE_QUALITY_EXACT;
+static span_shader_t span_shaders[NUM_SPAN_SHADINGS][NUM_DEPTH_TESTS][NUM_TEXTURE_INTERPOLATIONS];
+
+static int count_bits(unsigned int bits) {
+	int count = 0;
+	for (; bits != 0; bits &= bits - 1) {
+		count++;
+	}
+	return count;
+}
+
+FORCE_INLINE bool depth_test_passes(int depth_test, float depth, float stored_depth) {
+	return depth_test == DEPTH_TEST_EQUAL ? depth == stored_depth : depth < stored_depth;
+}
+
+// Depth stored for a pixel that was just shaded
+FORCE_INLINE float shaded_depth(int depth_test, float depth, int depth_format) {
+	if (depth_test != DEPTH_TEST_EQUAL) {
+		return depth;
+	}
+	return depth_format == DEPTH_FORMAT_FLOAT32 ? SHADED_DEPTH : SHADED_INTEGER_DEPTH;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Depth formats
+///////////////////////////////////////////////////////////////////////////////
+// Kernels work on the depth as a float in the units of the depth format. The
+// integer formats only hold whole numbers below 2^24, which floats represent
+// exactly, so every format shares the same depth tests and only the loads and
+// stores of the z-buffer differ.
+///////////////////////////////////////////////////////////////////////////////
+FORCE_INLINE float pixel_depth(const triangle_setup_t* setup, float reciprocal_w, int depth_format) {
+	if (depth_format == DEPTH_FORMAT_FLOAT32) {
+		// Adjust 1/w so the pixels that are closer to the camera have smaller values
+		return 1.0 - reciprocal_w;
+	}
+	float depth = setup->depth_offset + setup->depth_scale * reciprocal_w;
+	depth = depth < 1 ? 1 : (depth > setup->depth_max ? setup->depth_max : depth);
+	return (float)(int)depth;
+}
+
+FORCE_INLINE float load_depth(const void* z_buffer, int i, int depth_format) {
+	switch (depth_format) {
+		case DEPTH_FORMAT_UNORM24:	return (float)((const uint32_t*)z_buffer)[i];
+		case DEPTH_FORMAT_UNORM16:	return (float)((const uint16_t*)z_buffer)[i];
+		default:					return ((const float*)z_buffer)[i];
+	}
+}
+
+FORCE_INLINE void store_depth(void* z_buffer, int i, float depth, int depth_format) {
+	switch (depth_format) {
+		case DEPTH_FORMAT_UNORM24:	((uint32_t*)z_buffer)[i] = (uint32_t)depth; break;
+		case DEPTH_FORMAT_UNORM16:	((uint16_t*)z_buffer)[i] = (uint16_t)depth; break;
+		default:					((float*)z_buffer)[i] = depth; break;
+	}
+}
+
+// Offsets the z-buffer to the pixel with the given index
+FORCE_INLINE void* depth_at(int pixel, int depth_format) {
+	switch (depth_format) {
+		case DEPTH_FORMAT_UNORM24:	return (uint32_t*)get_z_buffer() + pixel;
+		case DEPTH_FORMAT_UNORM16:	return (uint16_t*)get_z_buffer() + pixel;
+		default:					return (float*)get_z_buffer() + pixel;
+	}
+}
+
+// Stamps out one kernel per depth format
+#define DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(define, name, ...) \
+	define(name##_float32, __VA_ARGS__, DEPTH_FORMAT_FLOAT32) \
+	define(name##_unorm24, __VA_ARGS__, DEPTH_FORMAT_UNORM24) \
+	define(name##_unorm16, __VA_ARGS__, DEPTH_FORMAT_UNORM16)
+
+#define SPAN_SHADERS_FOR_DEPTH_FORMATS(name) { name##_float32, name##_unorm24, name##_unorm16 }
+
+///////////////////////////////////////////////////////////////////////////////
+// Flat and depth-only kernels
+///////////////////////////////////////////////////////////////////////////////
+// A flat span is a depth compare and a fill with the triangle color, or only the fill without the depth test
+FORCE_INLINE int shade_flat_span(const triangle_setup_t* setup, int x, int y, int count, unsigned int mask, int depth_test, int depth_format) {
+	if (depth_test == DEPTH_TEST_NONE) {
+		uint32_t* color_buffer = get_color_buffer() + get_color_pixel_index(x, y);
+		for (int i = 0; i < count; i++) {
+			if (mask & (1u << i)) {
+				color_buffer[i] = setup->color;
+			}
+		}
+		return count_bits(mask);
+	}
+
+	float start_reciprocal_w = plane_at(setup->reciprocal_w, x - setup->anchor_x, y - setup->anchor_y);
+	// Spans never leave their 8x8 block, so they are contiguous in both buffer layouts
+	int pixel = get_pixel_index(x, y);
+	uint32_t* color_buffer = get_color_buffer() + get_color_pixel_index(x, y);
+	void* z_buffer = depth_at(pixel, depth_format);
+	int num_shaded = 0;
+
+	for (int i = 0; i < count; i++) {
+		float depth = pixel_depth(setup, start_reciprocal_w + setup->reciprocal_w.step_x * i, depth_format);
+
+		if ((mask & (1u << i)) && depth_test_passes(depth_test, depth, load_depth(z_buffer, i, depth_format))) {
+			color_buffer[i] = setup->color;
+			store_depth(z_buffer, i, shaded_depth(depth_test, depth, depth_format), depth_format);
+			num_shaded++;
+		}
+	}
+	return num_shaded;
+}
+
+// Depth-only kernel of the pre-pass, it must compute depth exactly like the textured kernels
+FORCE_INLINE int shade_depth_span(const triangle_setup_t* setup, int x, int y, int count, unsigned int mask, int depth_format) {
+	float start_reciprocal_w = plane_at(setup->reciprocal_w, x - setup->anchor_x, y - setup->anchor_y);
+	void* z_buffer = depth_at(get_pixel_index(x, y), depth_format);
+	int num_written = 0;
+
+	for (int i = 0; i < count; i++) {
+		float depth = pixel_depth(setup, start_reciprocal_w + setup->reciprocal_w.step_x * i, depth_format);
+		if ((mask & (1u << i)) && depth < load_depth(z_buffer, i, depth_format)) {
+			store_depth(z_buffer, i, depth, depth_format);
+			num_written++;
+		}
+	}
+	return num_written;
+}
+
+#define DEFINE_FLAT_SPAN_SHADER(name, depth_test, depth_format) \
+	static int name(const triangle_setup_t* setup, int x, int y, int count, unsigned int mask) { \
+		return shade_flat_span(setup, x, y, count, mask, depth_test, depth_format); \
+	}
+
+#define DEFINE_DEPTH_SPAN_SHADER(name, unused, depth_format) \
+	static int name(const triangle_setup_t* setup, int x, int y, int count, unsigned int mask) { \
+		return shade_depth_span(setup, x, y, count, mask, depth_format); \
+	}
+
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_FLAT_SPAN_SHADER, shade_flat_span_less, DEPTH_TEST_LESS)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_FLAT_SPAN_SHADER, shade_flat_span_equal, DEPTH_TEST_EQUAL)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_FLAT_SPAN_SHADER, shade_flat_span_none, DEPTH_TEST_NONE)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_DEPTH_SPAN_SHADER, shade_depth_span, DEPTH_TEST_LESS)
+
+///////////////////////////////////////////////////////////////////////////////
+// Scalar textured kernels
+///////////////////////////////////////////////////////////////////////////////
+// Triangle setup picks the interpolation of every triangle. Perspective is
+// the exact reference with a division per pixel. Affine triangles need no
+// division at all. Subdivided triangles only divide at the first and last
+// pixel of the span and interpolate u and v linearly between them. The depth
+// test and the depth values are the same for all three.
+///////////////////////////////////////////////////////////////////////////////
+#define DECLARE_SPAN_SHADER(name, ...) \
+	static int name(const triangle_setup_t* setup, int x, int y, int count, unsigned int mask);
+
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DECLARE_SPAN_SHADER, shade_textured_span_perspective_less, DEPTH_TEST_LESS)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DECLARE_SPAN_SHADER, shade_textured_span_perspective_equal, DEPTH_TEST_EQUAL)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DECLARE_SPAN_SHADER, shade_textured_span_perspective_none, DEPTH_TEST_NONE)
+
+// The exact scalar kernel is the fallback of every other textured kernel
+FORCE_INLINE int shade_textured_span_exact(const triangle_setup_t* setup, int x, int y, int count, unsigned int mask, int depth_test, int depth_format) {
+	static const span_shader_t exact_shaders[NUM_DEPTH_TESTS][NUM_DEPTH_FORMATS] = {
+		SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_perspective_less),
+		SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_perspective_equal),
+		SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_perspective_none)
+	};
+	return exact_shaders[depth_test][depth_format](setup, x, y, count, mask);
+}
+
+FORCE_INLINE int shade_textured_span_scalar(const triangle_setup_t* setup, int x, int y, int count, unsigned int mask, int depth_test, int interpolation, int depth_format) {
+	float dx = x - setup->anchor_x;
+	float dy = y - setup->anchor_y;
+	float start_reciprocal_w = plane_at(setup->reciprocal_w, dx, dy);
+	float start_u_over_w = plane_at(setup->u_over_w, dx, dy);
+	float start_v_over_w = plane_at(setup->v_over_w, dx, dy);
+
+	// Texture coordinates at the first pixel, and how much they change per pixel along the span
+	float start_u = 0, start_v = 0, step_u = 0, step_v = 0;
+	if (interpolation == TEXTURE_INTERPOLATION_AFFINE) {
+		start_u = start_u_over_w;
+		start_v = start_v_over_w;
+		step_u = setup->u_over_w.step_x;
+		step_v = setup->v_over_w.step_x;
+	}
+	else if (interpolation == TEXTURE_INTERPOLATION_SUBDIVIDED) {
+		int last = count - 1;
+		float end_reciprocal_w = start_reciprocal_w + setup->reciprocal_w.step_x * last;
+
+		// The span ends can lie outside the triangle, where 1/w is not guaranteed to be positive
+		if (start_reciprocal_w <= 0 || end_reciprocal_w <= 0) {
+			return shade_textured_span_exact(setup, x, y, count, mask, depth_test, depth_format);
+		}
+
+		float start_w = 1.0 / start_reciprocal_w;
+		float end_w = 1.0 / end_reciprocal_w;
+		start_u = start_u_over_w * start_w;
+		start_v = start_v_over_w * start_w;
+		float end_u = plane_at(setup->u_over_w, dx + last, dy) * end_w;
+		float end_v = plane_at(setup->v_over_w, dx + last, dy) * end_w;
+		step_u = last > 0 ? (end_u - start_u) / last : 0;
+		step_v = last > 0 ? (end_v - start_v) / last : 0;
+	}
+
+	int pixel = get_pixel_index(x, y);
+	uint32_t* color_buffer = get_color_buffer() + get_color_pixel_index(x, y);
+	void* z_buffer = depth_at(pixel, depth_format);
+	int num_shaded = 0;
+
+	for (int i = 0; i < count; i++) {
+		if (!(mask & (1u << i))) {
+			continue;
+		}
+
+		float reciprocal_w = start_reciprocal_w + setup->reciprocal_w.step_x * i;
+		float depth = pixel_depth(setup, reciprocal_w, depth_format);
+
+		// The texture lookup is only done for pixels that pass the depth test
+		if (depth_test == DEPTH_TEST_NONE || depth_test_passes(depth_test, depth, load_depth(z_buffer, i, depth_format))) {
+			float u, v;
+			if (interpolation == TEXTURE_INTERPOLATION_PERSPECTIVE) {
+				// Undo the perspective scaling of u and v with a single division
+				float w = 1.0 / reciprocal_w;
+				u = (start_u_over_w + setup->u_over_w.step_x * i) * w;
+				v = (start_v_over_w + setup->v_over_w.step_x * i) * w;
+			}
+			else {
+				u = start_u + step_u * i;
+				v = start_v + step_v * i;
+			}
+
+			// Map the uv coordinate to the full texture width and height
+			int tex_x = abs((int)(u * setup->texture_width)) % setup->texture_width;
+			int tex_y = abs((int)(v * setup->texture_height)) % setup->texture_height;
+
+			color_buffer[i] = setup->texture_buffer[(setup->texture_width * tex_y) + tex_x];
+			if (depth_test != DEPTH_TEST_NONE) {
+				store_depth(z_buffer, i, shaded_depth(depth_test, depth, depth_format), depth_format);
+			}
+			num_shaded++;
+		}
+	}
+	return num_shaded;
+}
+
+#define DEFINE_TEXTURED_SPAN_SHADER(name, depth_test, interpolation, depth_format) \
+	static int name(const triangle_setup_t* setup, int x, int y, int count, unsigned int mask) { \
+		return shade_textured_span_scalar(setup, x, y, count, mask, depth_test, interpolation, depth_format); \
+	}
+
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_TEXTURED_SPAN_SHADER, shade_textured_span_perspective_less, DEPTH_TEST_LESS, TEXTURE_INTERPOLATION_PERSPECTIVE)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_TEXTURED_SPAN_SHADER, shade_textured_span_perspective_equal, DEPTH_TEST_EQUAL, TEXTURE_INTERPOLATION_PERSPECTIVE)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_TEXTURED_SPAN_SHADER, shade_textured_span_perspective_none, DEPTH_TEST_NONE, TEXTURE_INTERPOLATION_PERSPECTIVE)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_TEXTURED_SPAN_SHADER, shade_textured_span_subdivided_less, DEPTH_TEST_LESS, TEXTURE_INTERPOLATION_SUBDIVIDED)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_TEXTURED_SPAN_SHADER, shade_textured_span_subdivided_equal, DEPTH_TEST_EQUAL, TEXTURE_INTERPOLATION_SUBDIVIDED)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_TEXTURED_SPAN_SHADER, shade_textured_span_subdivided_none, DEPTH_TEST_NONE, TEXTURE_INTERPOLATION_SUBDIVIDED)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_TEXTURED_SPAN_SHADER, shade_textured_span_affine_less, DEPTH_TEST_LESS, TEXTURE_INTERPOLATION_AFFINE)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_TEXTURED_SPAN_SHADER, shade_textured_span_affine_equal, DEPTH_TEST_EQUAL, TEXTURE_INTERPOLATION_AFFINE)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_TEXTURED_SPAN_SHADER, shade_textured_span_affine_none, DEPTH_TEST_NONE, TEXTURE_INTERPOLATION_AFFINE)
+
+#ifdef SPAN_HAS_X86_KERNELS
+
+///////////////////////////////////////////////////////////////////////////////
+// SSE2 kernel, two groups of 4 pixels per block row
+///////////////////////////////////////////////////////////////////////////////
+// Wrap a non-negative float integer n into [0, size) using exact float math
+static __m128 wrap_texcoord_sse2(__m128 n, __m128 size, __m128 inv_size) {
+	__m128 quotient = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(n, inv_size)));
+	__m128 remainder = _mm_sub_ps(n, _mm_mul_ps(quotient, size));
+	remainder = _mm_add_ps(remainder, _mm_and_ps(_mm_cmplt_ps(remainder, _mm_setzero_ps()), size));
+	remainder = _mm_sub_ps(remainder, _mm_and_ps(_mm_cmpge_ps(remainder, size), size));
+	return remainder;
+}
+
+// Convert u * size into the positive float integer abs((int)(u * size))
+static __m128 truncate_abs_sse2(__m128 scaled) {
+	__m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(scaled));
+	return _mm_andnot_ps(_mm_set1_ps(-0.0f), truncated);
+}
+
+// Depth of 4 pixels, with the same math as pixel_depth
+FORCE_INLINE __m128 pixel_depth_sse2(const triangle_setup_t* setup, __m128 reciprocal_w, int depth_format) {
+	if (depth_format == DEPTH_FORMAT_FLOAT32) {
+		return _mm_sub_ps(_mm_set1_ps(1.0f), reciprocal_w);
+	}
+	__m128 depth = _mm_add_ps(_mm_set1_ps(setup->depth_offset), _mm_mul_ps(_mm_set1_ps(setup->depth_scale), reciprocal_w));
+	depth = _mm_min_ps(_mm_max_ps(depth, _mm_set1_ps(1.0f)), _mm_set1_ps(setup->depth_max));
+	return _mm_cvtepi32_ps(_mm_cvttps_epi32(depth));
+}
+
+FORCE_INLINE __m128 load_depth_sse2(const void* z_buffer, int base, int depth_format) {
+	switch (depth_format) {
+		case DEPTH_FORMAT_UNORM24:
+			return _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)((const uint32_t*)z_buffer + base)));
+		case DEPTH_FORMAT_UNORM16:
+			return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)((const uint16_t*)z_buffer + base)), _mm_setzero_si128()));
+		default:
+			return _mm_loadu_ps((const float*)z_buffer + base);
+	}
+}
+
+// Masked store of the depth of the pixels that passed
+FORCE_INLINE void store_depth_sse2(void* z_buffer, int base, __m128 depth, __m128 pass, int depth_format) {
+	if (depth_format == DEPTH_FORMAT_FLOAT32) {
+		float* destination = (float*)z_buffer + base;
+		_mm_storeu_ps(destination, _mm_or_ps(_mm_and_ps(pass, depth), _mm_andnot_ps(pass, _mm_loadu_ps(destination))));
+		return;
+	}
+
+	__m128i pass_mask = _mm_castps_si128(pass);
+	__m128i value = _mm_cvttps_epi32(depth);
+	if (depth_format == DEPTH_FORMAT_UNORM24) {
+		__m128i* destination = (__m128i*)((uint32_t*)z_buffer + base);
+		_mm_storeu_si128(destination, _mm_or_si128(_mm_and_si128(pass_mask, value), _mm_andnot_si128(pass_mask, _mm_loadu_si128(destination))));
+		return;
+	}
+
+	// SSE2 only packs with signed saturation, so the 16-bit values are moved into the signed range and back
+	__m128i* destination = (__m128i*)((uint16_t*)z_buffer + base);
+	__m128i old_value = _mm_unpacklo_epi16(_mm_loadl_epi64(destination), _mm_setzero_si128());
+	__m128i blended = _mm_or_si128(_mm_and_si128(pass_mask, value), _mm_andnot_si128(pass_mask, old_value));
+	__m128i biased = _mm_sub_epi32(blended, _mm_set1_epi32(32768));
+	__m128i packed = _mm_xor_si128(_mm_packs_epi32(biased, biased), _mm_set1_epi16((short)0x8000));
+	_mm_storel_epi64(destination, packed);
+}
+
+FORCE_INLINE int shade_textured_span_sse2(const triangle_setup_t* setup, int x, int y, int count, unsigned int mask, int depth_test, int depth_format) {
+	if (count != SPAN_WIDTH || setup->texture_width * setup->texture_height > EXACT_TEXEL_INDEX_LIMIT) {
+		return shade_textured_span_exact(setup, x, y, count, mask, depth_test, depth_format);
+	}
+
+	float dx = x - setup->anchor_x;
+	float dy = y - setup->anchor_y;
+	__m128 start_reciprocal_w = _mm_set1_ps(plane_at(setup->reciprocal_w, dx, dy));
+	__m128 start_u_over_w = _mm_set1_ps(plane_at(setup->u_over_w, dx, dy));
+	__m128 start_v_over_w = _mm_set1_ps(plane_at(setup->v_over_w, dx, dy));
+	__m128 step_reciprocal_w = _mm_set1_ps(setup->reciprocal_w.step_x);
+	__m128 step_u_over_w = _mm_set1_ps(setup->u_over_w.step_x);
+	__m128 step_v_over_w = _mm_set1_ps(setup->v_over_w.step_x);
+
+	__m128 texture_width = _mm_set1_ps((float)setup->texture_width);
+	__m128 texture_height = _mm_set1_ps((float)setup->texture_height);
+	__m128 inv_texture_width = _mm_set1_ps(1.0f / setup->texture_width);
+	__m128 inv_texture_height = _mm_set1_ps(1.0f / setup->texture_height);
+	__m128 limit = _mm_set1_ps(EXACT_FLOAT_INTEGER_LIMIT);
+	__m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+
+	int pixel = get_pixel_index(x, y);
+	uint32_t* color_buffer = get_color_buffer() + get_color_pixel_index(x, y);
+	void* z_buffer = depth_at(pixel, depth_format);
+
+	__m128 colors[2];
+	__m128 depths[2];
+	__m128 pass[2];
+	int pass_bits[2];
+
+	for (int half = 0; half < 2; half++) {
+		int base = half * 4;
+		__m128 lane = _mm_setr_ps(base + 0, base + 1, base + 2, base + 3);
+		__m128i lane_bits = _mm_setr_epi32(1 << (base + 0), 1 << (base + 1), 1 << (base + 2), 1 << (base + 3));
+		__m128 coverage = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(mask), lane_bits), lane_bits));
+
+		// Interpolate 1/w and run the depth test for the 4 pixels
+		__m128 reciprocal_w = _mm_add_ps(start_reciprocal_w, _mm_mul_ps(step_reciprocal_w, lane));
+		if (depth_test == DEPTH_TEST_NONE) {
+			pass[half] = coverage;
+		}
+		else {
+			__m128 depth = pixel_depth_sse2(setup, reciprocal_w, depth_format);
+			__m128 stored_depth = load_depth_sse2(z_buffer, base, depth_format);
+			__m128 depth_passed = depth_test == DEPTH_TEST_EQUAL ? _mm_cmpeq_ps(depth, stored_depth) : _mm_cmplt_ps(depth, stored_depth);
+			pass[half] = _mm_and_ps(coverage, depth_passed);
+			depths[half] = depth_test == DEPTH_TEST_EQUAL ? _mm_set1_ps(shaded_depth(depth_test, 0, depth_format)) : depth;
+		}
+		pass_bits[half] = _mm_movemask_ps(pass[half]);
+		if (pass_bits[half] == 0) {
+			continue;
+		}
+
+		// Perspective divide and scale to texels
+		__m128 w = _mm_div_ps(_mm_set1_ps(1.0f), reciprocal_w);
+		__m128 u = _mm_mul_ps(_mm_add_ps(start_u_over_w, _mm_mul_ps(step_u_over_w, lane)), w);
+		__m128 v = _mm_mul_ps(_mm_add_ps(start_v_over_w, _mm_mul_ps(step_v_over_w, lane)), w);
+		__m128 scaled_u = _mm_mul_ps(u, texture_width);
+		__m128 scaled_v = _mm_mul_ps(v, texture_height);
+
+		// Rare huge texture coordinates are left to the scalar reference
+		__m128 in_range = _mm_and_ps(
+			_mm_cmplt_ps(_mm_and_ps(scaled_u, abs_mask), limit),
+			_mm_cmplt_ps(_mm_and_ps(scaled_v, abs_mask), limit)
+		);
+		if ((_mm_movemask_ps(in_range) & pass_bits[half]) != pass_bits[half]) {
+			return shade_textured_span_exact(setup, x, y, count, mask, depth_test, depth_format);
+		}
+
+		__m128 tex_x = wrap_texcoord_sse2(truncate_abs_sse2(scaled_u), texture_width, inv_texture_width);
+		__m128 tex_y = wrap_texcoord_sse2(truncate_abs_sse2(scaled_v), texture_height, inv_texture_height);
+		__m128i texel_index = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(tex_y, texture_width), tex_x));
+
+		// SSE2 has no gather, so the texels are fetched one lane at a time
+		int indices[4];
+		uint32_t texels[4] = { 0, 0, 0, 0 };
+		_mm_storeu_si128((__m128i*)indices, texel_index);
+		for (int i = 0; i < 4; i++) {
+			if (pass_bits[half] & (1 << i)) {
+				texels[i] = setup->texture_buffer[indices[i]];
+			}
+		}
+		colors[half] = _mm_castsi128_ps(_mm_loadu_si128((__m128i*)texels));
+	}
+
+	// Masked store of the color and depth of the pixels that passed
+	int num_shaded = 0;
+	for (int half = 0; half < 2; half++) {
+		if (pass_bits[half] == 0) {
+			continue;
+		}
+		int base = half * 4;
+		__m128 old_colors = _mm_loadu_ps((float*)(color_buffer + base));
+		_mm_storeu_ps((float*)(color_buffer + base), _mm_or_ps(_mm_and_ps(pass[half], colors[half]), _mm_andnot_ps(pass[half], old_colors)));
+		if (depth_test != DEPTH_TEST_NONE) {
+			store_depth_sse2(z_buffer, base, depths[half], pass[half], depth_format);
+		}
+		num_shaded += count_bits(pass_bits[half]);
+	}
+	return num_shaded;
+}
+
+#define DEFINE_SSE2_SPAN_SHADER(name, depth_test, depth_format) \
+	static int name(const triangle_setup_t* setup, int x, int y, int count, unsigned int mask) { \
+		return shade_textured_span_sse2(setup, x, y, count, mask, depth_test, depth_format); \
+	}
+
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_SSE2_SPAN_SHADER, shade_textured_span_sse2_less, DEPTH_TEST_LESS)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_SSE2_SPAN_SHADER, shade_textured_span_sse2_equal, DEPTH_TEST_EQUAL)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_SSE2_SPAN_SHADER, shade_textured_span_sse2_none, DEPTH_TEST_NONE)
+
+///////////////////////////////////////////////////////////////////////////////
+// AVX2 kernel, the whole block row of 8 pixels at once
+///////////////////////////////////////////////////////////////////////////////
+TARGET_AVX2
+static __m256 wrap_texcoord_avx2(__m256 n, __m256 size, __m256 inv_size) {
+	__m256 quotient = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(_mm256_mul_ps(n, inv_size)));
+	__m256 remainder = _mm256_sub_ps(n, _mm256_mul_ps(quotient, size));
+	remainder = _mm256_add_ps(remainder, _mm256_and_ps(_mm256_cmp_ps(remainder, _mm256_setzero_ps(), _CMP_LT_OQ), size));
+	remainder = _mm256_sub_ps(remainder, _mm256_and_ps(_mm256_cmp_ps(remainder, size, _CMP_GE_OQ), size));
+	return remainder;
+}
+
+TARGET_AVX2
+static __m256 truncate_abs_avx2(__m256 scaled) {
+	__m256 truncated = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(scaled));
+	return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), truncated);
+}
+
+TARGET_AVX2
+FORCE_INLINE __m256 pixel_depth_avx2(const triangle_setup_t* setup, __m256 reciprocal_w, int depth_format) {
+	if (depth_format == DEPTH_FORMAT_FLOAT32) {
+		return _mm256_sub_ps(_mm256_set1_ps(1.0f), reciprocal_w);
+	}
+	__m256 depth = _mm256_add_ps(_mm256_set1_ps(setup->depth_offset), _mm256_mul_ps(_mm256_set1_ps(setup->depth_scale), reciprocal_w));
+	depth = _mm256_min_ps(_mm256_max_ps(depth, _mm256_set1_ps(1.0f)), _mm256_set1_ps(setup->depth_max));
+	return _mm256_cvtepi32_ps(_mm256_cvttps_epi32(depth));
+}
+
+TARGET_AVX2
+FORCE_INLINE __m256 load_depth_avx2(const void* z_buffer, int depth_format) {
+	switch (depth_format) {
+		case DEPTH_FORMAT_UNORM24:
+			return _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)z_buffer));
+		case DEPTH_FORMAT_UNORM16:
+			return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)z_buffer)));
+		default:
+			return _mm256_loadu_ps((const float*)z_buffer);
+	}
+}
+
+TARGET_AVX2
+FORCE_INLINE void store_depth_avx2(void* z_buffer, __m256 depth, __m256 pass, int depth_format) {
+	if (depth_format == DEPTH_FORMAT_FLOAT32) {
+		_mm256_storeu_ps((float*)z_buffer, _mm256_blendv_ps(_mm256_loadu_ps((float*)z_buffer), depth, pass));
+		return;
+	}
+
+	__m256i pass_mask = _mm256_castps_si256(pass);
+	__m256i value = _mm256_cvttps_epi32(depth);
+	if (depth_format == DEPTH_FORMAT_UNORM24) {
+		_mm256_storeu_si256((__m256i*)z_buffer, _mm256_blendv_epi8(_mm256_loadu_si256((__m256i*)z_buffer), value, pass_mask));
+		return;
+	}
+
+	__m256i old_value = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i*)z_buffer));
+	__m256i blended = _mm256_blendv_epi8(old_value, value, pass_mask);
+	_mm_storeu_si128((__m128i*)z_buffer, _mm_packus_epi32(_mm256_castsi256_si128(blended), _mm256_extracti128_si256(blended, 1)));
+}
+
+TARGET_AVX2
+FORCE_INLINE int shade_textured_span_avx2(const triangle_setup_t* setup, int x, int y, int count, unsigned int mask, int depth_test, int depth_format) {
+	if (count != SPAN_WIDTH || setup->texture_width * setup->texture_height > EXACT_TEXEL_INDEX_LIMIT) {
+		return shade_textured_span_exact(setup, x, y, count, mask, depth_test, depth_format);
+	}
+
+	float dx = x - setup->anchor_x;
+	float dy = y - setup->anchor_y;
+	__m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+	__m256 coverage = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), lane_bits), lane_bits));
+
+	int pixel = get_pixel_index(x, y);
+	uint32_t* color_buffer = get_color_buffer() + get_color_pixel_index(x, y);
+	void* z_buffer = depth_at(pixel, depth_format);
+
+	// Interpolate 1/w and run the depth test for the 8 pixels
+	__m256 reciprocal_w = _mm256_add_ps(
+		_mm256_set1_ps(plane_at(setup->reciprocal_w, dx, dy)),
+		_mm256_mul_ps(_mm256_set1_ps(setup->reciprocal_w.step_x), lane)
+	);
+	__m256 depth = _mm256_setzero_ps();
+	__m256 pass = coverage;
+	if (depth_test != DEPTH_TEST_NONE) {
+		depth = pixel_depth_avx2(setup, reciprocal_w, depth_format);
+		__m256 stored_depth = load_depth_avx2(z_buffer, depth_format);
+		__m256 depth_passed = depth_test == DEPTH_TEST_EQUAL
+			? _mm256_cmp_ps(depth, stored_depth, _CMP_EQ_OQ)
+			: _mm256_cmp_ps(depth, stored_depth, _CMP_LT_OQ);
+		pass = _mm256_and_ps(coverage, depth_passed);
+	}
+	int pass_bits = _mm256_movemask_ps(pass);
+	if (pass_bits == 0) {
+		return 0;
+	}
+
+	// Perspective divide and scale to texels
+	__m256 w = _mm256_div_ps(_mm256_set1_ps(1.0f), reciprocal_w);
+	__m256 u = _mm256_mul_ps(_mm256_add_ps(
+		_mm256_set1_ps(plane_at(setup->u_over_w, dx, dy)),
+		_mm256_mul_ps(_mm256_set1_ps(setup->u_over_w.step_x), lane)
+	), w);
+	__m256 v = _mm256_mul_ps(_mm256_add_ps(
+		_mm256_set1_ps(plane_at(setup->v_over_w, dx, dy)),
+		_mm256_mul_ps(_mm256_set1_ps(setup->v_over_w.step_x), lane)
+	), w);
+
+	__m256 texture_width = _mm256_set1_ps((float)setup->texture_width);
+	__m256 texture_height = _mm256_set1_ps((float)setup->texture_height);
+	__m256 scaled_u = _mm256_mul_ps(u, texture_width);
+	__m256 scaled_v = _mm256_mul_ps(v, texture_height);
+
+	// Rare huge texture coordinates are left to the scalar reference
+	__m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+	__m256 limit = _mm256_set1_ps(EXACT_FLOAT_INTEGER_LIMIT);
+	__m256 in_range = _mm256_and_ps(
+		_mm256_cmp_ps(_mm256_and_ps(scaled_u, abs_mask), limit, _CMP_LT_OQ),
+		_mm256_cmp_ps(_mm256_and_ps(scaled_v, abs_mask), limit, _CMP_LT_OQ)
+	);
+	if ((_mm256_movemask_ps(in_range) & pass_bits) != pass_bits) {
+		return shade_textured_span_exact(setup, x, y, count, mask, depth_test, depth_format);
+	}
+
+	__m256 tex_x = wrap_texcoord_avx2(truncate_abs_avx2(scaled_u), texture_width, _mm256_set1_ps(1.0f / setup->texture_width));
+	__m256 tex_y = wrap_texcoord_avx2(truncate_abs_avx2(scaled_v), texture_height, _mm256_set1_ps(1.0f / setup->texture_height));
+	__m256i texel_index = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(tex_y, texture_width), tex_x));
+
+	// Gather only the texels of the pixels that passed the depth test
+	__m256i colors = _mm256_mask_i32gather_epi32(
+		_mm256_setzero_si256(), (const int*)setup->texture_buffer, texel_index, _mm256_castps_si256(pass), 4
+	);
+
+	// Masked store of the color and depth of the pixels that passed
+	__m256 old_colors = _mm256_loadu_ps((float*)color_buffer);
+	_mm256_storeu_ps((float*)color_buffer, _mm256_blendv_ps(old_colors, _mm256_castsi256_ps(colors), pass));
+	if (depth_test != DEPTH_TEST_NONE) {
+		__m256 new_depth = depth_test == DEPTH_TEST_EQUAL ? _mm256_set1_ps(shaded_depth(depth_test, 0, depth_format)) : depth;
+		store_depth_avx2(z_buffer, new_depth, pass, depth_format);
+	}
+	return count_bits(pass_bits);
+}
+
+#define DEFINE_AVX2_SPAN_SHADER(name, depth_test, depth_format) \
+	TARGET_AVX2 \
+	static int name(const triangle_setup_t* setup, int x, int y, int count, unsigned int mask) { \
+		return shade_textured_span_avx2(setup, x, y, count, mask, depth_test, depth_format); \
+	}
+
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_AVX2_SPAN_SHADER, shade_textured_span_avx2_less, DEPTH_TEST_LESS)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_AVX2_SPAN_SHADER, shade_textured_span_avx2_equal, DEPTH_TEST_EQUAL)
+DEFINE_SPAN_SHADERS_FOR_DEPTH_FORMATS(DEFINE_AVX2_SPAN_SHADER, shade_textured_span_avx2_none, DEPTH_TEST_NONE)
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Kernel selection
+///////////////////////////////////////////////////////////////////////////////
+static bool is_span_kernel_supported(int kernel) {
+	switch (kernel) {
+		case SPAN_KERNEL_SCALAR:
+			return true;
+#ifdef SPAN_HAS_X86_KERNELS
+		case SPAN_KERNEL_SSE2:
+			return SDL_HasSSE2();
+		case SPAN_KERNEL_AVX2:
+			return SDL_HasAVX2();
+#endif
+		default:
+			return false;
+	}
+}
+
+// Picks the widest kernel the CPU running the program supports
+void init_span_kernels(void) {
+	if (is_span_kernel_supported(SPAN_KERNEL_AVX2)) {
+		span_kernel = SPAN_KERNEL_AVX2;
+	}
+	else if (is_span_kernel_supported(SPAN_KERNEL_SSE2)) {
+		span_kernel = SPAN_KERNEL_SSE2;
+	}
+	else {
+		span_kernel = SPAN_KERNEL_SCALAR;
+	}
+	resolve_span_shaders();
+}
+
+bool set_span_kernel(int kernel) {
+	if (!is_span_kernel_supported(kernel)) {
+		return false;
+	}
+	span_kernel = kernel;
+	return true;
+}
+
+int get_span_kernel(void) {
+	return span_kernel;
+}
+
+// The fast quality only changes the interpolation triangle setup picks, the kernel table covers all of them
+void set_texture_quality(int quality) {
+	texture_quality = quality;
+}
+
+bool is_texture_quality_fast(void) {
+	return texture_quality == TEXTURE_QUALITY_FAST;
+}
+
+// Fills the kernel table for the current span kernel and depth format, called once per frame before rasterizing
+void resolve_span_shaders(void) {
+	static const span_shader_t depth_shaders[NUM_DEPTH_FORMATS] = SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_depth_span);
+	static const span_shader_t flat_shaders[NUM_DEPTH_TESTS][NUM_DEPTH_FORMATS] = {
+		SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_flat_span_less),
+		SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_flat_span_equal),
+		SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_flat_span_none)
+	};
+	static const span_shader_t textured_shaders[NUM_DEPTH_TESTS][NUM_TEXTURE_INTERPOLATIONS][NUM_DEPTH_FORMATS] = {
+		{
+			SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_perspective_less),
+			SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_subdivided_less),
+			SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_affine_less)
+		},
+		{
+			SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_perspective_equal),
+			SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_subdivided_equal),
+			SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_affine_equal)
+		},
+		{
+			SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_perspective_none),
+			SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_subdivided_none),
+			SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_affine_none)
+		}
+	};
+#ifdef SPAN_HAS_X86_KERNELS
+	static const span_shader_t sse2_shaders[NUM_DEPTH_TESTS][NUM_DEPTH_FORMATS] = {
+		SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_sse2_less),
+		SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_sse2_equal),
+		SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_sse2_none)
+	};
+	static const span_shader_t avx2_shaders[NUM_DEPTH_TESTS][NUM_DEPTH_FORMATS] = {
+		SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_avx2_less),
+		SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_avx2_equal),
+		SPAN_SHADERS_FOR_DEPTH_FORMATS(shade_textured_span_avx2_none)
+	};
+#endif
+
+	int depth_format = get_depth_format();
+	for (int depth_test = 0; depth_test < NUM_DEPTH_TESTS; depth_test++) {
+		for (int interpolation = 0; interpolation < NUM_TEXTURE_INTERPOLATIONS; interpolation++) {
+			span_shaders[SPAN_SHADING_DEPTH][depth_test][interpolation] = depth_shaders[depth_format];
+			span_shaders[SPAN_SHADING_FLAT][depth_test][interpolation] = flat_shaders[depth_test][depth_format];
+			span_shaders[SPAN_SHADING_TEXTURED][depth_test][interpolation] = textured_shaders[depth_test][interpolation][depth_format];
+		}
+
+		// Exact perspective is the only interpolation the vector kernels do
+		span_shader_t* perspective_shader = &span_shaders[SPAN_SHADING_TEXTURED][depth_test][TEXTURE_INTERPOLATION_PERSPECTIVE];
+		switch (span_kernel) {
+#ifdef SPAN_HAS_X86_KERNELS
+			case SPAN_KERNEL_SSE2:
+				*perspective_shader = sse2_shaders[depth_test][depth_format];
+				break;
+			case SPAN_KERNEL_AVX2:
+				*perspective_shader = avx2_shaders[depth_test][depth_format];
+				break;
+#endif
+			default:
+				break;
+		}
+	}
+}
+
+span_shader_t get_span_shader(int shading, int depth_test, int interpolation) {
+	return span_shaders[shading][depth_test][interpolation];
+}
\ No newline at end of file
@@ -0,0 +1,42 @@
+#ifndef SPAN_H
+#define SPAN_H
+
+#include <stdbool.h>
+#include "triangle.h"
+
+// Draws up to one block row of pixels starting at (x, y), bit i of mask selects pixel x + i
+// The span never crosses the boundary of an 8x8 block, so it is contiguous in either buffer layout
+// Returns how many pixels were written
+typedef int (*span_shader_t)(const triangle_setup_t* setup, int x, int y, int count, unsigned int mask);
+
+enum span_kernel {
+	SPAN_KERNEL_SCALAR,
+	SPAN_KERNEL_SSE2,
+	SPAN_KERNEL_AVX2
+};
+
+// What a span shader writes: depth only, a flat color, or texels
+enum span_shading {
+	SPAN_SHADING_DEPTH,
+	SPAN_SHADING_FLAT,
+	SPAN_SHADING_TEXTURED,
+	NUM_SPAN_SHADINGS
+};
+
+enum texture_quality {
+	TEXTURE_QUALITY_EXACT,
+	TEXTURE_QUALITY_FAST
+};
+
+// Largest texture coordinate error, in texels, that the fast texture quality allows per triangle
+#define FAST_TEXTURE_MAX_TEXEL_ERROR 1.0f
+
+void init_span_kernels(void);
+bool set_span_kernel(int kernel);
+int get_span_kernel(void);
+void set_texture_quality(int quality);
+bool is_texture_quality_fast(void);
+void resolve_span_shaders(void);
+span_shader_t get_span_shader(int shading, int depth_test, int interpolation);
+
+#endif
\ No newline at end of file
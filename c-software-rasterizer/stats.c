@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <SDL.h>
+#include "stats.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Per-frame pipeline counters
+///////////////////////////////////////////////////////////////////////////////
+// Counters are atomic because the tile workers add to them concurrently.
+// Callers should sum locally and add once per triangle, not once per pixel.
+// The triangle queue growths are counted since startup, not per frame, since
+// the queues keep their capacity and only grow in the first few frames. The
+// triangle queue peak is the most triangles any frame so far queued.
+///////////////////////////////////////////////////////////////////////////////
+static SDL_atomic_t counters[NUM_STAT_COUNTERS];
+static bool is_output_enabled = false;
+static Uint32 last_output_time = 0;
+
+static const char* counter_names[NUM_STAT_COUNTERS] = {
+	"triangles rasterized",
+	"hi-z blocks rejected",
+	"hi-z pixel tests avoided",
+	"hi-z triangles rejected",
+	"pixels shaded",
+	"depth pre-pass pixels written",
+	"triangles textured affine",
+	"triangles textured subdivided",
+	"small triangles",
+	"small triangles without samples",
+	"guard band overflow clips",
+	"triangles trivially accepted",
+	"triangles trivially rejected",
+	"triangles clipped",
+	"blocks left cleared",
+	"vertices transformed",
+	"triangle queue peak",
+	"triangle queue capacity",
+	"triangle queue growths (total)",
+	"meshes culled",
+	"meshes inside frustum"
+};
+
+void set_stats_output(bool is_enabled) {
+	is_output_enabled = is_enabled;
+}
+
+bool is_stats_output_enabled(void) {
+	return is_output_enabled;
+}
+
+void begin_stats_frame(void) {
+	for (int i = 0; i < NUM_STAT_COUNTERS; i++) {
+		if (i != STAT_TRIANGLE_QUEUE_GROWTHS) {
+			SDL_AtomicSet(&counters[i], 0);
+		}
+	}
+}
+
+void add_stat(int counter, int amount) {
+	if (amount != 0) {
+		SDL_AtomicAdd(&counters[counter], amount);
+	}
+}
+
+int get_stat(int counter) {
+	return SDL_AtomicGet(&counters[counter]);
+}
+
+// Prints the counters of the frame that just finished, at most once per second
+void end_stats_frame(void) {
+	if (!is_output_enabled || SDL_GetTicks() - last_output_time < 1000) {
+		return;
+	}
+	last_output_time = SDL_GetTicks();
+
+	printf("Frame statistics:\n");
+	for (int i = 0; i < NUM_STAT_COUNTERS; i++) {
+		printf("  %-32s %d\n", counter_names[i], get_stat(i));
+	}
+
+	// Share of the rasterized triangles that took the small triangle path
+	if (get_stat(STAT_TRIANGLES_RASTERIZED) > 0) {
+		printf("  %-32s %.1f%%\n", "small triangle share", 100.0 * get_stat(STAT_SMALL_TRIANGLES) / get_stat(STAT_TRIANGLES_RASTERIZED));
+	}
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+
+enum stat_counter {
+	STAT_TRIANGLES_RASTERIZED,
+	STAT_HIZ_BLOCKS_REJECTED,
+	STAT_HIZ_PIXEL_TESTS_AVOIDED,
+	STAT_HIZ_TRIANGLES_REJECTED,
+	STAT_PIXELS_SHADED,
+	STAT_DEPTH_PREPASS_PIXELS,
+	STAT_TRIANGLES_AFFINE,
+	STAT_TRIANGLES_SUBDIVIDED,
+	STAT_SMALL_TRIANGLES,
+	STAT_SMALL_TRIANGLES_EMPTY,
+	STAT_GUARD_BAND_CLIPS,
+	STAT_TRIANGLES_TRIVIALLY_ACCEPTED,
+	STAT_TRIANGLES_TRIVIALLY_REJECTED,
+	STAT_TRIANGLES_CLIPPED,
+	STAT_BLOCKS_LEFT_CLEARED,
+	STAT_VERTICES_TRANSFORMED,
+	STAT_TRIANGLE_QUEUE_PEAK,
+	STAT_TRIANGLE_QUEUE_CAPACITY,
+	STAT_TRIANGLE_QUEUE_GROWTHS,
+	STAT_MESHES_CULLED,
+	STAT_MESHES_INSIDE_FRUSTUM,
+	NUM_STAT_COUNTERS
+};
+
+void set_stats_output(bool is_enabled);
+bool is_stats_output_enabled(void);
+void begin_stats_frame(void);
+void add_stat(int counter, int amount);
+int get_stat(int counter);
+void end_stats_frame(void);
+
+#endif
\ No newline at end of file
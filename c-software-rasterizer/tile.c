@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <SDL.h>
+#include "display.h"
+#include "tile.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Sort-middle tiled renderer
+///////////////////////////////////////////////////////////////////////////////
+// The screen is cut into 64x64 tiles. Every frame the projected triangles are
+// binned into the tiles their bounding box touches, keeping the submission
+// order inside each tile. The bins point straight into the triangle queues of
+// the geometry chunks, so no triangle is copied. Worker threads then take
+// whole tiles one at a time and rasterize every triangle of that tile,
+// clipped to the tile. Each tile owns its part of the color buffer and
+// z-buffer, so no locking is needed while drawing and the result is the same
+// as drawing serially. The same workers also run the geometry stage, through
+// run_on_tile_workers().
+///////////////////////////////////////////////////////////////////////////////
+//
+//      +--------+--------+--------+
+//      | tile 0 | tile 1 | tile 2 |   tile_offsets[t] is where the triangle
+//      |   /\   |        |        |   pointers of tile t start in the
+//      +--/--\--+--------+--------+   binned_triangles array, and
+//      | /____\ | tile 4 | tile 5 |   tile_offsets[t + 1] is where they end
+//      +--------+--------+--------+
+//
+///////////////////////////////////////////////////////////////////////////////
+static int num_tiles_x = 0;
+static int num_tiles_y = 0;
+static int* tile_offsets = NULL;
+static int* tile_cursors = NULL;
+static triangle_t** binned_triangles = NULL;
+static int binned_capacity = 0;
+
+static SDL_atomic_t next_tile;
+static void (*frame_job)(void) = NULL;	// Work of the current frame generation, rasterize_tiles() or a job of run_on_tile_workers()
+
+// Worker threads sleep on work_ready until a new frame generation is posted
+static SDL_Thread* workers[MAX_TILE_WORKERS];
+static int num_workers = 0;
+static SDL_mutex* work_lock = NULL;
+static SDL_cond* work_ready = NULL;
+static SDL_cond* work_done = NULL;
+static int frame_generation = 0;
+static int busy_workers = 0;
+static bool is_quitting = false;
+
+static screen_rect_t get_tile_rect(int tile) {
+	int tile_x = tile % num_tiles_x;
+	int tile_y = tile / num_tiles_x;
+	screen_rect_t rect = {
+		.min_x = tile_x * TILE_SIZE,
+		.min_y = tile_y * TILE_SIZE,
+		.max_x = (tile_x + 1) * TILE_SIZE - 1,
+		.max_y = (tile_y + 1) * TILE_SIZE - 1
+	};
+	if (rect.max_x > get_window_width() - 1) rect.max_x = get_window_width() - 1;
+	if (rect.max_y > get_window_height() - 1) rect.max_y = get_window_height() - 1;
+	return rect;
+}
+
+// Draws the tiles handed out by the shared counter until none are left
+static void rasterize_tiles(void) {
+	int num_tiles = num_tiles_x * num_tiles_y;
+	bool is_depth_prepass = should_render_depth_prepass();
+	bool is_filled = should_render_filled_triangles();
+	bool is_textured = should_render_textured_triangles();
+	int tile;
+	while ((tile = SDL_AtomicAdd(&next_tile, 1)) < num_tiles) {
+		screen_rect_t rect = get_tile_rect(tile);
+
+		// The depth pre-pass of a tile is finished before any pixel of that tile is shaded
+		if (is_depth_prepass) {
+			for (int i = tile_offsets[tile]; i < tile_offsets[tile + 1]; i++) {
+				draw_triangle_depth_in_rect(binned_triangles[i], rect);
+			}
+		}
+
+		for (int i = tile_offsets[tile]; i < tile_offsets[tile + 1]; i++) {
+			triangle_t* triangle = binned_triangles[i];
+			if (is_filled) {
+				draw_filled_triangle_in_rect(triangle, rect);
+			}
+			if (is_textured) {
+				draw_textured_triangle_in_rect(triangle, rect);
+			}
+		}
+	}
+}
+
+static int tile_worker(void* data) {
+	int seen_generation = 0;
+
+	SDL_LockMutex(work_lock);
+	while (true) {
+		while (!is_quitting && frame_generation == seen_generation) {
+			SDL_CondWait(work_ready, work_lock);
+		}
+		if (is_quitting) {
+			break;
+		}
+		seen_generation = frame_generation;
+		SDL_UnlockMutex(work_lock);
+
+		frame_job();
+
+		SDL_LockMutex(work_lock);
+		busy_workers--;
+		if (busy_workers == 0) {
+			SDL_CondSignal(work_done);
+		}
+	}
+	SDL_UnlockMutex(work_lock);
+	return 0;
+}
+
+bool init_tile_renderer(void) {
+	num_tiles_x = (get_window_width() + TILE_SIZE - 1) / TILE_SIZE;
+	num_tiles_y = (get_window_height() + TILE_SIZE - 1) / TILE_SIZE;
+	tile_offsets = (int*)malloc(sizeof(int) * (num_tiles_x * num_tiles_y + 1));
+	tile_cursors = (int*)malloc(sizeof(int) * (num_tiles_x * num_tiles_y));
+
+	work_lock = SDL_CreateMutex();
+	work_ready = SDL_CreateCond();
+	work_done = SDL_CreateCond();
+	if (!tile_offsets || !tile_cursors || !work_lock || !work_ready || !work_done) {
+		fprintf(stderr, "Error initializing the tile renderer.\n");
+		return false;
+	}
+
+	// The main thread rasterizes tiles too, so one worker less than the number of cores is started
+	int num_threads = SDL_GetCPUCount() - 1;
+	if (num_threads > MAX_TILE_WORKERS) num_threads = MAX_TILE_WORKERS;
+	for (int i = 0; i < num_threads; i++) {
+		workers[num_workers] = SDL_CreateThread(tile_worker, "tile_worker", NULL);
+		if (workers[num_workers] == NULL) {
+			break;
+		}
+		num_workers++;
+	}
+	return true;
+}
+
+int get_num_tile_workers(void) {
+	return num_workers;
+}
+
+// Counting sort of the triangles into tiles, keeping the submission order inside every tile
+static bool bin_triangles(const triangle_queue_t* queues, int num_queues) {
+	int num_tiles = num_tiles_x * num_tiles_y;
+	for (int t = 0; t <= num_tiles; t++) {
+		tile_offsets[t] = 0;
+	}
+
+	// First pass counts how many triangles land in every tile
+	for (int pass = 0; pass < 2; pass++) {
+		for (int queue = 0; queue < num_queues; queue++) {
+			for (int i = 0; i < queues[queue].count; i++) {
+				triangle_t* triangle = &queues[queue].triangles[i];
+				vec4_t* points = triangle->points;
+				int min_x = points[0].x, max_x = points[0].x;
+				int min_y = points[0].y, max_y = points[0].y;
+				for (int j = 1; j < 3; j++) {
+					if ((int)points[j].x < min_x) min_x = points[j].x;
+					if ((int)points[j].x > max_x) max_x = points[j].x;
+					if ((int)points[j].y < min_y) min_y = points[j].y;
+					if ((int)points[j].y > max_y) max_y = points[j].y;
+				}
+				if (max_x < 0 || max_y < 0 || min_x >= get_window_width() || min_y >= get_window_height()) {
+					continue;
+				}
+				int first_tile_x = min_x < 0 ? 0 : min_x / TILE_SIZE;
+				int first_tile_y = min_y < 0 ? 0 : min_y / TILE_SIZE;
+				int last_tile_x = max_x >= get_window_width() ? num_tiles_x - 1 : max_x / TILE_SIZE;
+				int last_tile_y = max_y >= get_window_height() ? num_tiles_y - 1 : max_y / TILE_SIZE;
+
+				for (int tile_y = first_tile_y; tile_y <= last_tile_y; tile_y++) {
+					for (int tile_x = first_tile_x; tile_x <= last_tile_x; tile_x++) {
+						int tile = tile_y * num_tiles_x + tile_x;
+						if (pass == 0) {
+							tile_offsets[tile + 1]++;
+						}
+						else {
+							binned_triangles[tile_cursors[tile]++] = triangle;
+						}
+					}
+				}
+			}
+		}
+
+		// Between the passes the counts become offsets and the pointer array is grown if needed
+		if (pass == 0) {
+			for (int t = 0; t < num_tiles; t++) {
+				tile_offsets[t + 1] += tile_offsets[t];
+				tile_cursors[t] = tile_offsets[t];
+			}
+			if (tile_offsets[num_tiles] > binned_capacity) {
+				int capacity = tile_offsets[num_tiles] * 2;
+				triangle_t** binned = (triangle_t**)realloc(binned_triangles, sizeof(triangle_t*) * capacity);
+				if (binned == NULL) {
+					fprintf(stderr, "Error growing the array of binned triangles.\n");
+					return false;
+				}
+				binned_triangles = binned;
+				binned_capacity = capacity;
+			}
+		}
+	}
+	return true;
+}
+
+// Runs the job on every worker and on the main thread, and returns once all of them are done with it
+void run_on_tile_workers(void (*job)(void)) {
+	// Wake the workers up for the new frame generation
+	SDL_LockMutex(work_lock);
+	frame_job = job;
+	frame_generation++;
+	busy_workers = num_workers;
+	SDL_CondBroadcast(work_ready);
+	SDL_UnlockMutex(work_lock);
+
+	// Help with the job, then wait for the workers that are still running it
+	job();
+
+	SDL_LockMutex(work_lock);
+	while (busy_workers > 0) {
+		SDL_CondWait(work_done, work_lock);
+	}
+	SDL_UnlockMutex(work_lock);
+}
+
+// Skips the triangles of the frame if they cannot be binned
+void render_tiles(const triangle_queue_t* queues, int num_queues) {
+	if (!bin_triangles(queues, num_queues)) {
+		return;
+	}
+	SDL_AtomicSet(&next_tile, 0);
+	run_on_tile_workers(rasterize_tiles);
+}
+
+void destroy_tile_renderer(void) {
+	SDL_LockMutex(work_lock);
+	is_quitting = true;
+	SDL_CondBroadcast(work_ready);
+	SDL_UnlockMutex(work_lock);
+
+	for (int i = 0; i < num_workers; i++) {
+		SDL_WaitThread(workers[i], NULL);
+	}
+	num_workers = 0;
+
+	SDL_DestroyCond(work_done);
+	SDL_DestroyCond(work_ready);
+	SDL_DestroyMutex(work_lock);
+	free(binned_triangles);
+	free(tile_cursors);
+	free(tile_offsets);
+}
\ No newline at end of file
@@ -0,0 +1,16 @@
+#ifndef TILE_H
+#define TILE_H
+
+#include <stdbool.h>
+#include "triangle.h"
+
+#define TILE_SIZE 64
+#define MAX_TILE_WORKERS 64
+
+bool init_tile_renderer(void);
+int get_num_tile_workers(void);
+void run_on_tile_workers(void (*job)(void));
+void render_tiles(const triangle_queue_t* queues, int num_queues);
+void destroy_tile_renderer(void);
+
+#endif
\ No newline at end of file
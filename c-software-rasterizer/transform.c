@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL.h>
+#include "clipping.h"
+#include "transform.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Batch vertex transform
+///////////////////////////////////////////////////////////////////////////////
+// Every unique vertex of a mesh goes through the same fused matrix once per
+// frame. With the positions stored as one array per coordinate, a vector load
+// picks up the same coordinate of 4 (SSE2) or 8 (AVX2) consecutive vertices,
+// and each row of the matrix becomes a broadcast multiply-add over all of
+// them. The outcodes come from the same compares as compute_outcode(), done
+// per lane, and the results are transposed back into the vec4_t arrays the
+// face loop gathers from. The vector kernels round exactly like the scalar
+// one, so the kernel picked for the CPU never changes a pixel.
+///////////////////////////////////////////////////////////////////////////////
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TRANSFORM_HAS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+#if defined(_MSC_VER)
+#define FORCE_INLINE static __forceinline
+#else
+#define FORCE_INLINE static inline __attribute__((always_inline))
+#endif
+
+// Keeps the multiplies and adds of the scalar transform from being fused into FMA instructions
+// the vector kernels do not use, see also mat4_mul_vec4 in matrix.c
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#elif defined(_MSC_VER)
+#pragma fp_contract(off)
+#endif
+
+static int transform_kernel = TRANSFORM_KERNEL_SCALAR;
+
+vertex_positions_t make_vertex_positions(const vec3_t* vertices, int count) {
+	vertex_positions_t positions = {
+		.x = (float*)malloc(sizeof(float) * count),
+		.y = (float*)malloc(sizeof(float) * count),
+		.z = (float*)malloc(sizeof(float) * count),
+		.count = count
+	};
+	for (int i = 0; i < count; i++) {
+		positions.x[i] = vertices[i].x;
+		positions.y[i] = vertices[i].y;
+		positions.z[i] = vertices[i].z;
+	}
+	return positions;
+}
+
+void free_vertex_positions(vertex_positions_t* positions) {
+	free(positions->x);
+	free(positions->y);
+	free(positions->z);
+	memset(positions, 0, sizeof(vertex_positions_t));
+}
+
+// Camera space is only needed for the face normals, and comes back from clip space with two divides
+static void transform_vertex(const mat4_t* world_view_proj_matrix, const mat4_t* proj_matrix, const vertex_positions_t* positions, int i, vec4_t* clip_vertices, vec4_t* camera_vertices, int* outcodes) {
+	vec4_t model_vertex = { positions->x[i], positions->y[i], positions->z[i], 1.0 };
+	clip_vertices[i] = mat4_mul_vec4(*world_view_proj_matrix, model_vertex);
+	camera_vertices[i] = mat4_unproject_perspective(*proj_matrix, clip_vertices[i]);
+	outcodes[i] = compute_outcode(clip_vertices[i]);
+}
+
+#ifdef TRANSFORM_HAS_X86_KERNELS
+///////////////////////////////////////////////////////////////////////////////
+// SSE2 kernel, 4 vertices at a time
+///////////////////////////////////////////////////////////////////////////////
+// Same order of operations as mat4_mul_vec4 with w = 1
+FORCE_INLINE __m128 transform_row_sse2(const mat4_t* m, int row, __m128 x, __m128 y, __m128 z) {
+	__m128 result = _mm_mul_ps(_mm_set1_ps(m->m[row][0]), x);
+	result = _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(m->m[row][1]), y));
+	result = _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(m->m[row][2]), z));
+	return _mm_add_ps(result, _mm_set1_ps(m->m[row][3]));
+}
+
+FORCE_INLINE __m128i outcode_bit_sse2(__m128 is_outside, int bit) {
+	return _mm_and_si128(_mm_castps_si128(is_outside), _mm_set1_epi32(bit));
+}
+
+FORCE_INLINE __m128i compute_outcodes_sse2(__m128 x, __m128 y, __m128 z, __m128 w) {
+	__m128 negative_w = _mm_sub_ps(_mm_setzero_ps(), w);
+	__m128 guard_w = _mm_mul_ps(w, _mm_set1_ps(GUARD_BAND_SCALE));
+	__m128 negative_guard_w = _mm_sub_ps(_mm_setzero_ps(), guard_w);
+	__m128i outcodes = outcode_bit_sse2(_mm_cmplt_ps(x, negative_w), FRUSTUM_OUTCODE(LEFT_FRUSTUM_PLANE));
+	outcodes = _mm_or_si128(outcodes, outcode_bit_sse2(_mm_cmpgt_ps(x, w), FRUSTUM_OUTCODE(RIGHT_FRUSTUM_PLANE)));
+	outcodes = _mm_or_si128(outcodes, outcode_bit_sse2(_mm_cmpgt_ps(y, w), FRUSTUM_OUTCODE(TOP_FRUSTUM_PLANE)));
+	outcodes = _mm_or_si128(outcodes, outcode_bit_sse2(_mm_cmplt_ps(y, negative_w), FRUSTUM_OUTCODE(BOTTOM_FRUSTUM_PLANE)));
+	outcodes = _mm_or_si128(outcodes, outcode_bit_sse2(_mm_cmplt_ps(z, _mm_setzero_ps()), FRUSTUM_OUTCODE(NEAR_FRUSTUM_PLANE)));
+	outcodes = _mm_or_si128(outcodes, outcode_bit_sse2(_mm_cmpgt_ps(z, w), FRUSTUM_OUTCODE(FAR_FRUSTUM_PLANE)));
+	outcodes = _mm_or_si128(outcodes, outcode_bit_sse2(_mm_cmplt_ps(x, negative_guard_w), GUARD_BAND_OUTCODE(LEFT_FRUSTUM_PLANE)));
+	outcodes = _mm_or_si128(outcodes, outcode_bit_sse2(_mm_cmpgt_ps(x, guard_w), GUARD_BAND_OUTCODE(RIGHT_FRUSTUM_PLANE)));
+	outcodes = _mm_or_si128(outcodes, outcode_bit_sse2(_mm_cmpgt_ps(y, guard_w), GUARD_BAND_OUTCODE(TOP_FRUSTUM_PLANE)));
+	outcodes = _mm_or_si128(outcodes, outcode_bit_sse2(_mm_cmplt_ps(y, negative_guard_w), GUARD_BAND_OUTCODE(BOTTOM_FRUSTUM_PLANE)));
+	return outcodes;
+}
+
+// Transposes four lanes of x, y, z, and w back into four vec4_t
+FORCE_INLINE void store_vertices_sse2(vec4_t* vertices, __m128 x, __m128 y, __m128 z, __m128 w) {
+	_MM_TRANSPOSE4_PS(x, y, z, w);
+	_mm_storeu_ps(&vertices[0].x, x);
+	_mm_storeu_ps(&vertices[1].x, y);
+	_mm_storeu_ps(&vertices[2].x, z);
+	_mm_storeu_ps(&vertices[3].x, w);
+}
+
+static int transform_vertices_sse2(const mat4_t* world_view_proj_matrix, const mat4_t* proj_matrix, const vertex_positions_t* positions, vec4_t* clip_vertices, vec4_t* camera_vertices, int* outcodes) {
+	__m128 proj_x = _mm_set1_ps(proj_matrix->m[0][0]);
+	__m128 proj_y = _mm_set1_ps(proj_matrix->m[1][1]);
+	int i = 0;
+	for (; i + 4 <= positions->count; i += 4) {
+		__m128 x = _mm_loadu_ps(&positions->x[i]);
+		__m128 y = _mm_loadu_ps(&positions->y[i]);
+		__m128 z = _mm_loadu_ps(&positions->z[i]);
+		__m128 clip_x = transform_row_sse2(world_view_proj_matrix, 0, x, y, z);
+		__m128 clip_y = transform_row_sse2(world_view_proj_matrix, 1, x, y, z);
+		__m128 clip_z = transform_row_sse2(world_view_proj_matrix, 2, x, y, z);
+		__m128 clip_w = transform_row_sse2(world_view_proj_matrix, 3, x, y, z);
+
+		_mm_storeu_si128((__m128i*)&outcodes[i], compute_outcodes_sse2(clip_x, clip_y, clip_z, clip_w));
+		store_vertices_sse2(&camera_vertices[i], _mm_div_ps(clip_x, proj_x), _mm_div_ps(clip_y, proj_y), clip_w, _mm_set1_ps(1.0f));
+		store_vertices_sse2(&clip_vertices[i], clip_x, clip_y, clip_z, clip_w);
+	}
+	return i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AVX2 kernel, 8 vertices at a time
+///////////////////////////////////////////////////////////////////////////////
+FORCE_INLINE TARGET_AVX2 __m256 transform_row_avx2(const mat4_t* m, int row, __m256 x, __m256 y, __m256 z) {
+	__m256 result = _mm256_mul_ps(_mm256_set1_ps(m->m[row][0]), x);
+	result = _mm256_add_ps(result, _mm256_mul_ps(_mm256_set1_ps(m->m[row][1]), y));
+	result = _mm256_add_ps(result, _mm256_mul_ps(_mm256_set1_ps(m->m[row][2]), z));
+	return _mm256_add_ps(result, _mm256_set1_ps(m->m[row][3]));
+}
+
+FORCE_INLINE TARGET_AVX2 __m256i outcode_bit_avx2(__m256 is_outside, int bit) {
+	return _mm256_and_si256(_mm256_castps_si256(is_outside), _mm256_set1_epi32(bit));
+}
+
+FORCE_INLINE TARGET_AVX2 __m256i compute_outcodes_avx2(__m256 x, __m256 y, __m256 z, __m256 w) {
+	__m256 negative_w = _mm256_sub_ps(_mm256_setzero_ps(), w);
+	__m256 guard_w = _mm256_mul_ps(w, _mm256_set1_ps(GUARD_BAND_SCALE));
+	__m256 negative_guard_w = _mm256_sub_ps(_mm256_setzero_ps(), guard_w);
+	__m256i outcodes = outcode_bit_avx2(_mm256_cmp_ps(x, negative_w, _CMP_LT_OQ), FRUSTUM_OUTCODE(LEFT_FRUSTUM_PLANE));
+	outcodes = _mm256_or_si256(outcodes, outcode_bit_avx2(_mm256_cmp_ps(x, w, _CMP_GT_OQ), FRUSTUM_OUTCODE(RIGHT_FRUSTUM_PLANE)));
+	outcodes = _mm256_or_si256(outcodes, outcode_bit_avx2(_mm256_cmp_ps(y, w, _CMP_GT_OQ), FRUSTUM_OUTCODE(TOP_FRUSTUM_PLANE)));
+	outcodes = _mm256_or_si256(outcodes, outcode_bit_avx2(_mm256_cmp_ps(y, negative_w, _CMP_LT_OQ), FRUSTUM_OUTCODE(BOTTOM_FRUSTUM_PLANE)));
+	outcodes = _mm256_or_si256(outcodes, outcode_bit_avx2(_mm256_cmp_ps(z, _mm256_setzero_ps(), _CMP_LT_OQ), FRUSTUM_OUTCODE(NEAR_FRUSTUM_PLANE)));
+	outcodes = _mm256_or_si256(outcodes, outcode_bit_avx2(_mm256_cmp_ps(z, w, _CMP_GT_OQ), FRUSTUM_OUTCODE(FAR_FRUSTUM_PLANE)));
+	outcodes = _mm256_or_si256(outcodes, outcode_bit_avx2(_mm256_cmp_ps(x, negative_guard_w, _CMP_LT_OQ), GUARD_BAND_OUTCODE(LEFT_FRUSTUM_PLANE)));
+	outcodes = _mm256_or_si256(outcodes, outcode_bit_avx2(_mm256_cmp_ps(x, guard_w, _CMP_GT_OQ), GUARD_BAND_OUTCODE(RIGHT_FRUSTUM_PLANE)));
+	outcodes = _mm256_or_si256(outcodes, outcode_bit_avx2(_mm256_cmp_ps(y, guard_w, _CMP_GT_OQ), GUARD_BAND_OUTCODE(TOP_FRUSTUM_PLANE)));
+	outcodes = _mm256_or_si256(outcodes, outcode_bit_avx2(_mm256_cmp_ps(y, negative_guard_w, _CMP_LT_OQ), GUARD_BAND_OUTCODE(BOTTOM_FRUSTUM_PLANE)));
+	return outcodes;
+}
+
+FORCE_INLINE TARGET_AVX2 void store_vertices_avx2(vec4_t* vertices, __m256 x, __m256 y, __m256 z, __m256 w) {
+	store_vertices_sse2(&vertices[0], _mm256_castps256_ps128(x), _mm256_castps256_ps128(y), _mm256_castps256_ps128(z), _mm256_castps256_ps128(w));
+	store_vertices_sse2(&vertices[4], _mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1), _mm256_extractf128_ps(z, 1), _mm256_extractf128_ps(w, 1));
+}
+
+TARGET_AVX2
+static int transform_vertices_avx2(const mat4_t* world_view_proj_matrix, const mat4_t* proj_matrix, const vertex_positions_t* positions, vec4_t* clip_vertices, vec4_t* camera_vertices, int* outcodes) {
+	__m256 proj_x = _mm256_set1_ps(proj_matrix->m[0][0]);
+	__m256 proj_y = _mm256_set1_ps(proj_matrix->m[1][1]);
+	int i = 0;
+	for (; i + 8 <= positions->count; i += 8) {
+		__m256 x = _mm256_loadu_ps(&positions->x[i]);
+		__m256 y = _mm256_loadu_ps(&positions->y[i]);
+		__m256 z = _mm256_loadu_ps(&positions->z[i]);
+		__m256 clip_x = transform_row_avx2(world_view_proj_matrix, 0, x, y, z);
+		__m256 clip_y = transform_row_avx2(world_view_proj_matrix, 1, x, y, z);
+		__m256 clip_z = transform_row_avx2(world_view_proj_matrix, 2, x, y, z);
+		__m256 clip_w = transform_row_avx2(world_view_proj_matrix, 3, x, y, z);
+
+		_mm256_storeu_si256((__m256i*)&outcodes[i], compute_outcodes_avx2(clip_x, clip_y, clip_z, clip_w));
+		store_vertices_avx2(&camera_vertices[i], _mm256_div_ps(clip_x, proj_x), _mm256_div_ps(clip_y, proj_y), clip_w, _mm256_set1_ps(1.0f));
+		store_vertices_avx2(&clip_vertices[i], clip_x, clip_y, clip_z, clip_w);
+	}
+	return i;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Kernel selection
+///////////////////////////////////////////////////////////////////////////////
+static bool is_transform_kernel_supported(int kernel) {
+	switch (kernel) {
+		case TRANSFORM_KERNEL_SCALAR:
+			return true;
+#ifdef TRANSFORM_HAS_X86_KERNELS
+		case TRANSFORM_KERNEL_SSE2:
+			return SDL_HasSSE2();
+		case TRANSFORM_KERNEL_AVX2:
+			return SDL_HasAVX2();
+#endif
+		default:
+			return false;
+	}
+}
+
+// Picks the widest kernel the CPU running the program supports
+void init_transform_kernels(void) {
+	if (is_transform_kernel_supported(TRANSFORM_KERNEL_AVX2)) {
+		transform_kernel = TRANSFORM_KERNEL_AVX2;
+	}
+	else if (is_transform_kernel_supported(TRANSFORM_KERNEL_SSE2)) {
+		transform_kernel = TRANSFORM_KERNEL_SSE2;
+	}
+	else {
+		transform_kernel = TRANSFORM_KERNEL_SCALAR;
+	}
+}
+
+bool set_transform_kernel(int kernel) {
+	if (!is_transform_kernel_supported(kernel)) {
+		return false;
+	}
+	transform_kernel = kernel;
+	return true;
+}
+
+int get_transform_kernel(void) {
+	return transform_kernel;
+}
+
+// Transforms every position into clip space and camera space and computes its outcode, with the selected kernel
+void transform_vertices(mat4_t world_view_proj_matrix, mat4_t proj_matrix, const vertex_positions_t* positions, vec4_t* clip_vertices, vec4_t* camera_vertices, int* outcodes) {
+	int num_transformed = 0;
+	switch (transform_kernel) {
+#ifdef TRANSFORM_HAS_X86_KERNELS
+		case TRANSFORM_KERNEL_SSE2:
+			num_transformed = transform_vertices_sse2(&world_view_proj_matrix, &proj_matrix, positions, clip_vertices, camera_vertices, outcodes);
+			break;
+		case TRANSFORM_KERNEL_AVX2:
+			num_transformed = transform_vertices_avx2(&world_view_proj_matrix, &proj_matrix, positions, clip_vertices, camera_vertices, outcodes);
+			break;
+#endif
+		default:
+			break;
+	}
+
+	// Vertices left over from the last full vector, or all of them with the scalar kernel
+	for (int i = num_transformed; i < positions->count; i++) {
+		transform_vertex(&world_view_proj_matrix, &proj_matrix, positions, i, clip_vertices, camera_vertices, outcodes);
+	}
+}
+
+#ifdef TRANSFORM_BENCHMARK
+///////////////////////////////////////////////////////////////////////////////
+// Microbenchmark of builds with TRANSFORM_BENCHMARK defined
+///////////////////////////////////////////////////////////////////////////////
+// Transforms the positions over and over with every kernel the CPU supports
+// and prints the time per vertex. The matrices are those of a mesh 5 units in
+// front of the default camera, so the outcodes take their usual branches.
+///////////////////////////////////////////////////////////////////////////////
+#define BENCHMARK_VERTICES_PER_KERNEL 20000000
+
+void benchmark_transform_kernels(const char* name, const vertex_positions_t* positions) {
+	static const char* kernel_names[] = { "scalar", "SSE2", "AVX2" };
+	mat4_t proj_matrix = mat4_make_perspective(3.141592 / 3.0, 9.0 / 16.0, 0.1, 100.0);
+	mat4_t world_view_proj_matrix = mat4_mul_mat4(proj_matrix, mat4_make_translation(0, -1.3, 5));
+	vec4_t* clip_vertices = (vec4_t*)malloc(sizeof(vec4_t) * positions->count);
+	vec4_t* camera_vertices = (vec4_t*)malloc(sizeof(vec4_t) * positions->count);
+	int* outcodes = (int*)malloc(sizeof(int) * positions->count);
+	int num_repetitions = BENCHMARK_VERTICES_PER_KERNEL / positions->count + 1;
+	int selected_kernel = transform_kernel;
+
+	for (int kernel = TRANSFORM_KERNEL_SCALAR; kernel <= TRANSFORM_KERNEL_AVX2; kernel++) {
+		if (!set_transform_kernel(kernel)) {
+			continue;
+		}
+		transform_vertices(world_view_proj_matrix, proj_matrix, positions, clip_vertices, camera_vertices, outcodes);
+		Uint64 start = SDL_GetPerformanceCounter();
+		for (int i = 0; i < num_repetitions; i++) {
+			transform_vertices(world_view_proj_matrix, proj_matrix, positions, clip_vertices, camera_vertices, outcodes);
+		}
+		double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+		printf("%-16s %7d vertices  %-6s %6.2f ns per vertex\n", name, positions->count, kernel_names[kernel],
+			seconds * 1e9 / ((double)num_repetitions * positions->count));
+	}
+
+	transform_kernel = selected_kernel;
+	free(clip_vertices);
+	free(camera_vertices);
+	free(outcodes);
+}
+#endif
\ No newline at end of file
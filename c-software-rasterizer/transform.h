@@ -0,0 +1,32 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <stdbool.h>
+#include "vector.h"
+#include "matrix.h"
+
+enum transform_kernel {
+	TRANSFORM_KERNEL_SCALAR,
+	TRANSFORM_KERNEL_SSE2,
+	TRANSFORM_KERNEL_AVX2
+};
+
+// Model space vertex positions as one array per coordinate, so consecutive vertices fill the lanes of a vector
+typedef struct {
+	float* x;
+	float* y;
+	float* z;
+	int count;
+} vertex_positions_t;
+
+vertex_positions_t make_vertex_positions(const vec3_t* vertices, int count);
+void free_vertex_positions(vertex_positions_t* positions);
+void init_transform_kernels(void);
+bool set_transform_kernel(int kernel);
+int get_transform_kernel(void);
+void transform_vertices(mat4_t world_view_proj_matrix, mat4_t proj_matrix, const vertex_positions_t* positions, vec4_t* clip_vertices, vec4_t* camera_vertices, int* outcodes);
+#ifdef TRANSFORM_BENCHMARK
+void benchmark_transform_kernels(const char* name, const vertex_positions_t* positions);
+#endif
+
+#endif
\ No newline at end of file
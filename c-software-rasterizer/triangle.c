@@ -1,5 +1,8 @@
+#include <math.h>
 #include "triangle.h"
 #include "display.h"
+#include "span.h"
+#include "stats.h"
 #include "swap.h"
 
 vec3_t get_triangle_normal(vec4_t vertices[3]) {
@@ -19,45 +22,6 @@ vec3_t get_triangle_normal(vec4_t vertices[3]) {
 	return normal;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Return the barycentric weights alpha, beta, and gamma for point p
-///////////////////////////////////////////////////////////////////////////////
-//
-//          (B)
-//          /|\
-//         / | \
-//        /  |  \
-//       /  (P)  \
-//      /  /   \  \
-//     / /       \ \
-//	  //           \\
-//	(A)-------------(C)
-//
-///////////////////////////////////////////////////////////////////////////////
-vec3_t barycentric_weights(vec2_t a, vec2_t b, vec2_t c, vec2_t p) {
-	// Find the vectors between the vertices ABC and point p
-	vec2_t ac = vec2_sub(c, a);
-	vec2_t ab = vec2_sub(b, a);
-	vec2_t ap = vec2_sub(p, a);
-	vec2_t pc = vec2_sub(c, p);
-	vec2_t pb = vec2_sub(b, p);
-
-	// Compute the area of the full parallegram/triangle ABC using 2D cross product
-	float area_parallelogram_abc = (ac.x * ab.y - ac.y * ab.x); // || AC x AB ||
-
-	// Alpha is the area of the small parallelogram/triangle PBC divided by the area of the full parallelogram/triangle ABC
-	float alpha = (pc.x * pb.y - pc.y * pb.x) / area_parallelogram_abc;
-
-	// Beta is the area of the small parallelogram/triangle APC divided by the area of the full parallelogram/triangle ABC
-	float beta = (ac.x * ap.y - ac.y * ap.x) / area_parallelogram_abc;
-
-	// Weight gamma is easily found since barycentric coordinates always add up to 1.0
-	float gamma = 1 - alpha - beta;
-
-	vec3_t weights = { alpha, beta, gamma };
-	return weights;
-}
-
 ///////////////////////////////////////////////////////////////////////////////
 // Draw a triangle
 ///////////////////////////////////////////////////////////////////////////////
@@ -68,328 +32,517 @@ void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t colo
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Draw a solid pixel at position x and y using interpolation
+// Attribute planes computed once per triangle
 ///////////////////////////////////////////////////////////////////////////////
-void draw_triangle_pixel(
-	int x, int y, uint32_t color,
-	vec4_t point_a, vec4_t point_b, vec4_t point_c
-) {
-	vec2_t p = { x, y };
-	vec2_t a = vec2_from_vec4(point_a);
-	vec2_t b = vec2_from_vec4(point_b);
-	vec2_t c = vec2_from_vec4(point_c);
-
-	vec3_t weights = barycentric_weights(a, b, c, p);
-
-	// Barycentric weights
-	float alpha = weights.x;
-	float beta = weights.y;
-	float gamma = weights.z;
-
-	// Interpolate the value of 1/w for the current pixel
-	float interpolated_reciprocal_w = (1 / point_a.w) * alpha + (1 / point_b.w) * beta + (1 / point_c.w) * gamma;
-
-	// Adjust 1/w so the pixels that are closer to the camera have smaller values
-	interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
-
-	// Only draw this pixel if its depth value is less than the depth value of the pixel previously stored in the z-buffer
-	if (interpolated_reciprocal_w < get_zbuffer_at(x, y)) {
-		// Draw a pixel at position (x, y) with the color that comes from the mapped texture
-		draw_pixel(x, y, color);
-
-		// Update the z-buffer value with the 1/w of the current pixel
-		update_zbuffer_at(x, y, interpolated_reciprocal_w);
-	}
+// Any attribute that is linear in screen space (1/w, u/w, v/w) can be written
+// as a plane A(x, y) = A0 + step_x * (x - x0) + step_y * (y - y0), anchored
+// at the first vertex. The steps are found once per triangle from the edge
+// functions, so the pixel loop only adds deltas instead of recomputing the
+// barycentric weights and dividing by the triangle area at every pixel.
+///////////////////////////////////////////////////////////////////////////////
+float plane_at(attribute_plane_t plane, float dx, float dy) {
+	return plane.origin + plane.step_x * dx + plane.step_y * dy;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Draw a textured pixel at position x and y using interpolation
+// Edge function for the directed edge (x0,y0) -> (x1,y1)
 ///////////////////////////////////////////////////////////////////////////////
-void draw_triangle_texel(
-	int x, int y, upng_t* texture,
-	vec4_t point_a, vec4_t point_b, vec4_t point_c,
-	tex2_t a_uv, tex2_t b_uv, tex2_t c_uv
-) {
-	vec2_t p = { x, y };
-	vec2_t a = vec2_from_vec4(point_a);
-	vec2_t b = vec2_from_vec4(point_b);
-	vec2_t c = vec2_from_vec4(point_c);
-
-	vec3_t weights = barycentric_weights(a, b, c, p);
-
-	// Barycentric weights
-	float alpha = weights.x;
-	float beta = weights.y;
-	float gamma = weights.z;
-
-	// Variables that store the interpolated values of u/w, v/w, and 1/w per pixel
-	float interpolated_u;
-	float interpolated_v;
-	float interpolated_reciprocal_w;
-
-	// Perform interpolation of all u and v values using barycentric weights and a factor of 1/w
-	interpolated_u = (a_uv.u / point_a.w) * alpha + (b_uv.u / point_b.w) * beta + (c_uv.u / point_c.w) * gamma;
-	interpolated_v = (a_uv.v / point_a.w) * alpha + (b_uv.v / point_b.w) * beta + (c_uv.v / point_c.w) * gamma;
-
-	// Interpolate the value of 1/w for the current pixel
-	interpolated_reciprocal_w = (1 / point_a.w) * alpha + (1 / point_b.w) * beta + (1 / point_c.w) * gamma;
-
-	// Divide all attributes by 1/w
-	interpolated_u /= interpolated_reciprocal_w;
-	interpolated_v /= interpolated_reciprocal_w;
-
-	// Get the mesh texture width and height
-	int texture_width = upng_get_width(texture);
-	int texture_height = upng_get_height(texture);
-
-	// Map the uv coordinate to the full texture width and height
-	int tex_x = abs((int)(interpolated_u * texture_width)) % texture_width;
-	int tex_y = abs((int)(interpolated_v * texture_height)) % texture_height;
+// E(x, y) = (x1 - x0) * (y - y0) - (y1 - y0) * (x - x0)
+//
+// E is zero on the edge, positive on one side and negative on the other.
+// Once the triangle vertices are wound consistently, a pixel is inside when
+// all three edge functions are positive or zero. E is linear, so moving one
+// pixel to the right adds step_x and moving one pixel down adds step_y.
+//
+// Vertices are snapped to 28.4 fixed point (1/16 of a pixel) and E is
+// sampled at pixel centers, so all the stepping is exact integer math.
+// Pixels exactly on an edge belong to the triangle only when that edge is a
+// top or a left edge. Two triangles sharing an edge see it with opposite
+// directions, so exactly one of them draws the pixels on it.
+///////////////////////////////////////////////////////////////////////////////
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL_SCALE (1 << SUBPIXEL_BITS)
+#define SUBPIXEL_HALF (SUBPIXEL_SCALE / 2)
+
+typedef struct {
+	int64_t origin;	// Value of the edge function at the center of pixel (0, 0), with the fill rule bias
+	int64_t step_x;	// Increment when moving one pixel to the right
+	int64_t step_y;	// Increment when moving one pixel down
+} edge_t;
+
+static int to_subpixel(float coordinate) {
+	return (int)lrintf(coordinate * SUBPIXEL_SCALE);
+}
 
-	// Adjust 1/w so the pixels that are closer to the camera have smaller values
-	interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
+static edge_t edge_setup(int x0, int y0, int x1, int y1) {
+	int64_t delta_x = x1 - x0;
+	int64_t delta_y = y1 - y0;
 
-	// Only draw this pixel if its depth value is less than the depth value of the pixel previously stored in the z-buffer
-	if (interpolated_reciprocal_w < get_zbuffer_at(x, y)) {
-		// Get the buffer of colors from the texture
-		uint32_t* texture_buffer = (uint32_t*)upng_get_buffer(texture);
+	// With the winding used below, top edges run to the right and left edges run up the screen
+	bool is_top_left = (delta_y == 0 && delta_x > 0) || delta_y < 0;
 
-		// Draw a pixel at position (x, y) with the color that comes from the mapped texture
-		draw_pixel(x, y, texture_buffer[(texture_width * tex_y) + tex_x]);
+	edge_t edge = {
+		.origin = delta_x * (SUBPIXEL_HALF - y0) - delta_y * (SUBPIXEL_HALF - x0) - (is_top_left ? 0 : 1),
+		.step_x = -delta_y * SUBPIXEL_SCALE,
+		.step_y = delta_x * SUBPIXEL_SCALE
+	};
+	return edge;
+}
 
-		// Update the z-buffer value with the 1/w of the current pixel
-		update_zbuffer_at(x, y, interpolated_reciprocal_w);
-	}
+static int64_t edge_at(edge_t edge, int x, int y) {
+	return edge.origin + edge.step_x * x + edge.step_y * y;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Draw a filled triangle with the flat-top/flat-bottom method
-// The original triangle is split in two, half flat-bottom and half flat-top
+// Rasterize a triangle by walking its bounding box in 8x8 blocks
 ///////////////////////////////////////////////////////////////////////////////
 //
-//          (x0,y0)
-//            / \
-//           /   \
-//          /     \
-//         /       \
-//        /         \
-//   (x1,y1)-------(Mx,My)
-//       \_           \
-//          \_         \
-//             \_       \
-//                \_     \
-//                   \    \
-//                     \_  \
-//                        \_\
-//                           \
-//                         (x2,y2)
+//     +-------+-------+-------+
+//     |       |   /\  |       |   Blocks outside any edge are skipped
+//     |       | /####\|       |   Blocks inside all edges are filled
+//     +-------+/######\-------+   without testing pixels one by one
+//     |      /|########\      |   Blocks that straddle an edge test
+//     |    /##|#########\     |   every pixel with the edge functions
+//     +---/---+-------+--\----+
 //
 ///////////////////////////////////////////////////////////////////////////////
-void draw_filled_triangle(
-	int x0, int y0, float z0, float w0,
-	int x1, int y1, float z1, float w1,
-	int x2, int y2, float z2, float w2,
-	uint32_t color
-) {
-	// Sort vertices by ascending y-coordinate (y0 < y1 < y2)
-	if (y0 > y1) {
-		int_swap(&y0, &y1);
-		int_swap(&x0, &x1);
-		float_swap(&z0, &z1);
-		float_swap(&w0, &w1);
-	}
-	if (y1 > y2) {
-		int_swap(&y1, &y2);
-		int_swap(&x1, &x2);
-		float_swap(&z1, &z2);
-		float_swap(&w1, &w2);
+// Raster blocks line up with the blocks of the hierarchical z-buffer
+#define RASTER_BLOCK_SIZE HIZ_BLOCK_SIZE
+
+// Margin that keeps the hierarchical z-buffer conservative against float rounding in the span shaders
+#define HIZ_DEPTH_EPSILON 1.0e-5
+
+// Triangles whose bounding box is narrower and shorter than this many pixels skip the block walk
+#define SMALL_TRIANGLE_SIZE 4
+
+// Offsets from the anchor vertex to the center of the pixel it lies in, the origin of every plane
+static attribute_plane_t plane_setup(edge_t edges[3], float area, float offset_x, float offset_y, float a0, float a1, float a2) {
+	// The edge opposite each vertex divided by the area is that vertex's barycentric weight
+	attribute_plane_t plane = {
+		.step_x = (edges[0].step_x * a0 + edges[1].step_x * a1 + edges[2].step_x * a2) / area,
+		.step_y = (edges[0].step_y * a0 + edges[1].step_y * a1 + edges[2].step_y * a2) / area
+	};
+	plane.origin = a0 + plane.step_x * offset_x + plane.step_y * offset_y;
+	return plane;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Texture interpolation for the fast texture quality
+///////////////////////////////////////////////////////////////////////////////
+// Interpolating u affinely instead of u/w divided by 1/w is off by at most
+// half the range of u times (max 1/w / min 1/w - 1). Over the whole triangle
+// that is the error of affine mapping, and over one span row it is the error
+// of dividing at the span ends only. The cheapest interpolation whose error
+// is under FAST_TEXTURE_MAX_TEXEL_ERROR texels is used.
+///////////////////////////////////////////////////////////////////////////////
+static int choose_texture_interpolation(triangle_setup_t* setup, tex2_t texcoords[3], float reciprocal_w[3]) {
+	float min_reciprocal_w = reciprocal_w[0], max_reciprocal_w = reciprocal_w[0];
+	float min_u = texcoords[0].u, max_u = texcoords[0].u;
+	float min_v = texcoords[0].v, max_v = texcoords[0].v;
+	for (int i = 1; i < 3; i++) {
+		if (reciprocal_w[i] < min_reciprocal_w) min_reciprocal_w = reciprocal_w[i];
+		if (reciprocal_w[i] > max_reciprocal_w) max_reciprocal_w = reciprocal_w[i];
+		if (texcoords[i].u < min_u) min_u = texcoords[i].u;
+		if (texcoords[i].u > max_u) max_u = texcoords[i].u;
+		if (texcoords[i].v < min_v) min_v = texcoords[i].v;
+		if (texcoords[i].v > max_v) max_v = texcoords[i].v;
 	}
-	if (y0 > y1) {
-		int_swap(&y0, &y1);
-		int_swap(&x0, &x1);
-		float_swap(&z0, &z1);
-		float_swap(&w0, &w1);
+	if (min_reciprocal_w <= 0) {
+		return TEXTURE_INTERPOLATION_PERSPECTIVE;
 	}
 
-	// Create vector points and texture coordinates after the vertices are sorted
-	vec4_t point_a = { x0, y0, z0, w0 };
-	vec4_t point_b = { x1, y1, z1, w1 };
-	vec4_t point_c = { x2, y2, z2, w2 };
-
-	///////////////////////////////////////////////////////////////////////////////
-	// Render the upper triangle (flat-bottom)
-	///////////////////////////////////////////////////////////////////////////////
-	float inv_slope_1 = 0;
-	float inv_slope_2 = 0;
-
-	if (y1 - y0 != 0) inv_slope_1 = (float)(x1 - x0) / abs(y1 - y0);
-	if (y2 - y0 != 0) inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
-
-	if (y1 - y0 != 0) {
-		// Loop scanlines from top to bottom
-		for (int y = y0; y <= y1; y++) {
-			int x_start = x1 + (y - y1) * inv_slope_1;
-			int x_end = x0 + (y - y0) * inv_slope_2;
-
-			// Swap x_start and x_end if x_end is to the left of x_start (x_end, x_start --> x_start, x_end)
-			if (x_end < x_start) {
-				int_swap(&x_start, &x_end);
-			}
+	// Whole triangle
+	float texel_range = fmaxf((max_u - min_u) * setup->texture_width, (max_v - min_v) * setup->texture_height);
+	if (texel_range / 2 * (max_reciprocal_w / min_reciprocal_w - 1) <= FAST_TEXTURE_MAX_TEXEL_ERROR) {
+		return TEXTURE_INTERPOLATION_AFFINE;
+	}
 
-			// Draw each pixel with a solid color
-			for (int x = x_start; x < x_end; x++) {
-				draw_triangle_pixel(x, y, color, point_a, point_b, point_c);
-			}
-		}
+	// One span row, using the largest change of u and v per pixel anywhere in the triangle
+	float span_length = RASTER_BLOCK_SIZE - 1;
+	float step_reciprocal_w = fabsf(setup->reciprocal_w.step_x);
+	float max_abs_u = fmaxf(fabsf(min_u), fabsf(max_u));
+	float max_abs_v = fmaxf(fabsf(min_v), fabsf(max_v));
+	float span_texel_range_u = (fabsf(setup->u_over_w.step_x) + max_abs_u * step_reciprocal_w) / min_reciprocal_w * setup->texture_width;
+	float span_texel_range_v = (fabsf(setup->v_over_w.step_x) + max_abs_v * step_reciprocal_w) / min_reciprocal_w * setup->texture_height;
+	float span_texel_range = fmaxf(span_texel_range_u, span_texel_range_v) * span_length;
+	if (span_texel_range / 2 * (step_reciprocal_w * span_length / min_reciprocal_w) <= FAST_TEXTURE_MAX_TEXEL_ERROR) {
+		return TEXTURE_INTERPOLATION_SUBDIVIDED;
 	}
+	return TEXTURE_INTERPOLATION_PERSPECTIVE;
+}
 
-	///////////////////////////////////////////////////////////////////////////////
-	// Render the lower triangle (flat-top)
-	///////////////////////////////////////////////////////////////////////////////
-	inv_slope_1 = 0;
-	inv_slope_2 = 0;
+static int rasterize_triangle(vec4_t vertices[3], tex2_t texcoords[3], triangle_setup_t* setup, int shading, screen_rect_t rect) {
+	int x0 = to_subpixel(vertices[0].x), y0 = to_subpixel(vertices[0].y);
+	int x1 = to_subpixel(vertices[1].x), y1 = to_subpixel(vertices[1].y);
+	int x2 = to_subpixel(vertices[2].x), y2 = to_subpixel(vertices[2].y);
 
-	if (y2 - y1 != 0) inv_slope_1 = (float)(x2 - x1) / abs(y2 - y1);
-	if (y2 - y0 != 0) inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+	int index1 = 1;
+	int index2 = 2;
 
-	if (y2 - y1 != 0) {
-		// Loop scanlines from top to bottom
-		for (int y = y1; y <= y2; y++) {
-			int x_start = x1 + (y - y1) * inv_slope_1;
-			int x_end = x0 + (y - y0) * inv_slope_2;
+	// Wind the vertices so that the inside of the triangle is where all edge functions are positive
+	int64_t area = (int64_t)(x1 - x0) * (y2 - y0) - (int64_t)(y1 - y0) * (x2 - x0);
+	if (area == 0) {
+		return 0;
+	}
+	if (area < 0) {
+		int_swap(&x1, &x2);
+		int_swap(&y1, &y2);
+		int_swap(&index1, &index2);
+		area = -area;
+	}
 
-			// Swap x_start and x_end if x_end is to the left of x_start (x_end, x_start --> x_start, x_end)
-			if (x_end < x_start) {
-				int_swap(&x_start, &x_end);
-			}
+	edge_t edges[3] = {
+		edge_setup(x1, y1, x2, y2),
+		edge_setup(x2, y2, x0, y0),
+		edge_setup(x0, y0, x1, y1)
+	};
+
+	// Find the pixel bounding box of the triangle
+	int min_x = (x0 < x1 ? (x0 < x2 ? x0 : x2) : (x1 < x2 ? x1 : x2)) >> SUBPIXEL_BITS;
+	int min_y = (y0 < y1 ? (y0 < y2 ? y0 : y2) : (y1 < y2 ? y1 : y2)) >> SUBPIXEL_BITS;
+	int max_x = (x0 > x1 ? (x0 > x2 ? x0 : x2) : (x1 > x2 ? x1 : x2)) >> SUBPIXEL_BITS;
+	int max_y = (y0 > y1 ? (y0 > y2 ? y0 : y2) : (y1 > y2 ? y1 : y2)) >> SUBPIXEL_BITS;
+
+	// Small triangles are classified by their whole bounding box, a large triangle clipped to a thin strip of the
+	// rectangle stays on the block walk
+	bool is_small = max_x - min_x < SMALL_TRIANGLE_SIZE && max_y - min_y < SMALL_TRIANGLE_SIZE;
+
+	// Clamp the bounding box to the rectangle being drawn (screen or tile)
+	if (min_x < rect.min_x) min_x = rect.min_x;
+	if (min_y < rect.min_y) min_y = rect.min_y;
+	if (max_x > rect.max_x) max_x = rect.max_x;
+	if (max_y > rect.max_y) max_y = rect.max_y;
+	if (min_x > max_x || min_y > max_y) {
+		return 0;
+	}
 
-			// Draw each pixel with a solid color
-			for (int x = x_start; x < x_end; x++) {
-				draw_triangle_pixel(x, y, color, point_a, point_b, point_c);
+	// Small triangles test their few pixel centers directly, and the ones that cover no center are dropped before any setup
+	unsigned int small_masks[SMALL_TRIANGLE_SIZE];
+	if (is_small) {
+		unsigned int covered = 0;
+		for (int y = min_y; y <= max_y; y++) {
+			unsigned int mask = 0;
+			for (int x = min_x; x <= max_x; x++) {
+				if ((edge_at(edges[0], x, y) | edge_at(edges[1], x, y) | edge_at(edges[2], x, y)) >= 0) {
+					mask |= 1u << (x - min_x);
+				}
 			}
+			small_masks[y - min_y] = mask;
+			covered |= mask;
+		}
+		add_stat(STAT_TRIANGLES_RASTERIZED, 1);
+		add_stat(STAT_SMALL_TRIANGLES, 1);
+		if (covered == 0) {
+			add_stat(STAT_SMALL_TRIANGLES_EMPTY, 1);
+			return 0;
 		}
 	}
-}
 
-///////////////////////////////////////////////////////////////////////////////
-// Draw a textured triangle with the flat-top/flat-bottom method
-// The original triangle is split in two, half flat-bottom and half flat-top
-///////////////////////////////////////////////////////////////////////////////
-//
-//            v0
-//            / \
-//           /   \
-//          /     \
-//         /       \
-//        /         \
-//      v1           \
-//       \_           \
-//          \_         \
-//             \_       \
-//                \_     \
-//                   \    \
-//                     \_  \
-//                        \_\
-//                           \
-//                           v2
-//
-///////////////////////////////////////////////////////////////////////////////
-void draw_textured_triangle(
-	int x0, int y0, float z0, float w0, float u0, float v0,
-	int x1, int y1, float z1, float w1, float u1, float v1,
-	int x2, int y2, float z2, float w2, float u2, float v2,
-	upng_t* texture
-) {
-	// Sort vertices by ascending y-coordinate (y0 < y1 < y2)
-	if (y0 > y1) {
-		int_swap(&y0, &y1);
-		int_swap(&x0, &x1);
-		float_swap(&z0, &z1);
-		float_swap(&w0, &w1);
-		float_swap(&u0, &u1);
-		float_swap(&v0, &v1);
+	// Triangle setup: 1/w, u/w, and v/w become planes that the span shaders step through
+	float reciprocal_w0 = 1.0 / vertices[0].w;
+	float reciprocal_w1 = 1.0 / vertices[index1].w;
+	float reciprocal_w2 = 1.0 / vertices[index2].w;
+
+	// The planes are anchored at the center of the pixel holding the first vertex
+	setup->anchor_x = x0 >> SUBPIXEL_BITS;
+	setup->anchor_y = y0 >> SUBPIXEL_BITS;
+	float offset_x = (float)((setup->anchor_x << SUBPIXEL_BITS) + SUBPIXEL_HALF - x0) / SUBPIXEL_SCALE;
+	float offset_y = (float)((setup->anchor_y << SUBPIXEL_BITS) + SUBPIXEL_HALF - y0) / SUBPIXEL_SCALE;
+
+	setup->reciprocal_w = plane_setup(edges, area, offset_x, offset_y, reciprocal_w0, reciprocal_w1, reciprocal_w2);
+	if (get_depth_format() != DEPTH_FORMAT_FLOAT32) {
+		setup->depth_max = get_depth_format() == DEPTH_FORMAT_UNORM16 ? UNORM16_DEPTH_MAX : UNORM24_DEPTH_MAX;
+		setup->depth_offset = 1 + setup->depth_max * get_depth_offset();
+		setup->depth_scale = setup->depth_max * get_depth_scale();
 	}
-	if (y1 > y2) {
-		int_swap(&y1, &y2);
-		int_swap(&x1, &x2);
-		float_swap(&z1, &z2);
-		float_swap(&w1, &w2);
-		float_swap(&u1, &u2);
-		float_swap(&v1, &v2);
+	if (texcoords != NULL) {
+		setup->u_over_w = plane_setup(edges, area, offset_x, offset_y,
+			texcoords[0].u * reciprocal_w0, texcoords[index1].u * reciprocal_w1, texcoords[index2].u * reciprocal_w2);
+		setup->v_over_w = plane_setup(edges, area, offset_x, offset_y,
+			texcoords[0].v * reciprocal_w0, texcoords[index1].v * reciprocal_w1, texcoords[index2].v * reciprocal_w2);
+
+		setup->texture_interpolation = TEXTURE_INTERPOLATION_PERSPECTIVE;
+		if (is_texture_quality_fast()) {
+			float reciprocal_w[3] = { reciprocal_w0, reciprocal_w1, reciprocal_w2 };
+			tex2_t wound_texcoords[3] = { texcoords[0], texcoords[index1], texcoords[index2] };
+			setup->texture_interpolation = choose_texture_interpolation(setup, wound_texcoords, reciprocal_w);
+		}
+
+		// Affine triangles interpolate u and v themselves
+		if (setup->texture_interpolation == TEXTURE_INTERPOLATION_AFFINE) {
+			setup->u_over_w = plane_setup(edges, area, offset_x, offset_y, texcoords[0].u, texcoords[index1].u, texcoords[index2].u);
+			setup->v_over_w = plane_setup(edges, area, offset_x, offset_y, texcoords[0].v, texcoords[index1].v, texcoords[index2].v);
+			add_stat(STAT_TRIANGLES_AFFINE, 1);
+		}
+		else if (setup->texture_interpolation == TEXTURE_INTERPOLATION_SUBDIVIDED) {
+			add_stat(STAT_TRIANGLES_SUBDIVIDED, 1);
+		}
 	}
-	if (y0 > y1) {
-		int_swap(&y0, &y1);
-		int_swap(&x0, &x1);
-		float_swap(&z0, &z1);
-		float_swap(&w0, &w1);
-		float_swap(&u0, &u1);
-		float_swap(&v0, &v1);
+
+	// The specialized kernel for this triangle's render state comes from the table resolved for the frame
+	span_shader_t shade_span = get_span_shader(shading, setup->depth_test, setup->texture_interpolation);
+
+	// Blocks are drawn into only after their cleared values are written, the depth pre-pass only needs the depth
+	// and triangles drawn without the depth test only need the color
+	int cleared_buffers = shading == SPAN_SHADING_DEPTH ? BLOCK_DEPTH_CLEARED : BLOCK_COLOR_CLEARED | BLOCK_DEPTH_CLEARED;
+	bool is_depth_tested = setup->depth_test != DEPTH_TEST_NONE;
+	if (!is_depth_tested) {
+		cleared_buffers = BLOCK_COLOR_CLEARED;
 	}
 
-	// Flip the v component to account for inverted uv-coordinates (top-left start instead of bottom-left)
-	v0 = 1.0 - v0;
-	v1 = 1.0 - v1;
-	v2 = 1.0 - v2;
-
-	// Create vector points and texture coordinates after the vertices are sorted
-	vec4_t point_a = { x0, y0, z0, w0 };
-	vec4_t point_b = { x1, y1, z1, w1 };
-	vec4_t point_c = { x2, y2, z2, w2 };
-	tex2_t a_uv = { u0, v0 };
-	tex2_t b_uv = { u1, v1 };
-	tex2_t c_uv = { u2, v2 };
-
-	///////////////////////////////////////////////////////////////////////////////
-	// Render the upper triangle (flat-bottom)
-	///////////////////////////////////////////////////////////////////////////////
-	float inv_slope_1 = 0;
-	float inv_slope_2 = 0;
-
-	if (y1 - y0 != 0) inv_slope_1 = (float)(x1 - x0) / abs(y1 - y0);
-	if (y2 - y0 != 0) inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
-
-	if (y1 - y0 != 0) {
-		// Loop scanlines from top to bottom
-		for (int y = y0; y <= y1; y++) {
-			int x_start = x1 + (y - y1) * inv_slope_1;
-			int x_end = x0 + (y - y0) * inv_slope_2;
-
-			// Swap x_start and x_end if x_end is to the left of x_start (x_end, x_start --> x_start, x_end)
-			if (x_end < x_start) {
-				int_swap(&x_start, &x_end);
+	// A small triangle is never more than one short span per row and never covers a whole hierarchical z-buffer block
+	if (is_small) {
+		// The few blocks the bounding box can touch are at its corners
+		resolve_cleared_block(min_x, min_y, cleared_buffers);
+		resolve_cleared_block(max_x, min_y, cleared_buffers);
+		resolve_cleared_block(min_x, max_y, cleared_buffers);
+		resolve_cleared_block(max_x, max_y, cleared_buffers);
+
+		// Spans must not cross a block boundary, so a row that does is shaded as two spans
+		int first_count = (min_x | (RASTER_BLOCK_SIZE - 1)) - min_x + 1;
+		int width = max_x - min_x + 1;
+		if (first_count > width) first_count = width;
+
+		int num_pixels_written = 0;
+		for (int y = min_y; y <= max_y; y++) {
+			unsigned int mask = small_masks[y - min_y];
+			if (mask & ((1u << first_count) - 1)) {
+				num_pixels_written += shade_span(setup, min_x, y, first_count, mask & ((1u << first_count) - 1));
 			}
-
-			// Draw each pixel with the color code derived from the texture
-			for (int x = x_start; x < x_end; x++) {
-				draw_triangle_texel(x, y, texture, point_a, point_b, point_c, a_uv, b_uv, c_uv);
+			if (mask >> first_count) {
+				num_pixels_written += shade_span(setup, min_x + first_count, y, width - first_count, mask >> first_count);
 			}
 		}
+		return num_pixels_written;
 	}
 
-	///////////////////////////////////////////////////////////////////////////////
-	// Render the lower triangle (flat-top)
-	///////////////////////////////////////////////////////////////////////////////
-	inv_slope_1 = 0;
-	inv_slope_2 = 0;
-
-	if (y2 - y1 != 0) inv_slope_1 = (float)(x2 - x1) / abs(y2 - y1);
-	if (y2 - y0 != 0) inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
-
-	if (y2 - y1 != 0) {
-		// Loop scanlines from top to bottom
-		for (int y = y1; y <= y2; y++) {
-			int x_start = x1 + (y - y1) * inv_slope_1;
-			int x_end = x0 + (y - y0) * inv_slope_2;
+	// Align the walk to the block grid so blocks always start on a multiple of the block size
+	// Tiles start on a multiple of the block size too, so a block never straddles two tiles
+	min_x &= ~(RASTER_BLOCK_SIZE - 1);
+	min_y &= ~(RASTER_BLOCK_SIZE - 1);
+
+	// The nearest depth of the whole triangle is found at one of its vertices
+	float max_reciprocal_w = reciprocal_w0 > reciprocal_w1 ? reciprocal_w0 : reciprocal_w1;
+	if (reciprocal_w2 > max_reciprocal_w) max_reciprocal_w = reciprocal_w2;
+	float triangle_nearest_depth = 1.0 - max_reciprocal_w;
+
+	float* hiz_buffer = get_hiz_buffer();
+	int hiz_width = get_hiz_width();
+	int num_blocks_drawn = 0;
+	int num_blocks_rejected = 0;
+	int num_pixel_tests_avoided = 0;
+	int num_pixels_written = 0;
+
+	for (int block_y = min_y; block_y <= max_y; block_y += RASTER_BLOCK_SIZE) {
+		for (int block_x = min_x; block_x <= max_x; block_x += RASTER_BLOCK_SIZE) {
+			bool block_outside = false;
+			bool block_inside = true;
+
+			// Test the corners of the block against every edge
+			for (int i = 0; i < 3; i++) {
+				int64_t corner = edge_at(edges[i], block_x, block_y);
+				int64_t reach_x = edges[i].step_x * (RASTER_BLOCK_SIZE - 1);
+				int64_t reach_y = edges[i].step_y * (RASTER_BLOCK_SIZE - 1);
+				int64_t max_corner = corner + (reach_x > 0 ? reach_x : 0) + (reach_y > 0 ? reach_y : 0);
+				int64_t min_corner = corner + (reach_x < 0 ? reach_x : 0) + (reach_y < 0 ? reach_y : 0);
+				if (max_corner < 0) {
+					block_outside = true;
+					break;
+				}
+				if (min_corner < 0) {
+					block_inside = false;
+				}
+			}
+			if (block_outside) {
+				continue;
+			}
 
-			// Swap x_start and x_end if x_end is to the left of x_start (x_end, x_start --> x_start, x_end)
-			if (x_end < x_start) {
-				int_swap(&x_start, &x_end);
+			// Spans always cover the whole block row unless it is cut by the right edge of the rectangle
+			int end_y = block_y + RASTER_BLOCK_SIZE - 1 < max_y ? block_y + RASTER_BLOCK_SIZE - 1 : max_y;
+			int count = rect.max_x + 1 - block_x < RASTER_BLOCK_SIZE ? rect.max_x + 1 - block_x : RASTER_BLOCK_SIZE;
+
+			// Range of 1/w over the block, taken from the plane at the block corners
+			float corner_reciprocal_w = plane_at(setup->reciprocal_w, block_x - setup->anchor_x, block_y - setup->anchor_y);
+			float reach_x = setup->reciprocal_w.step_x * (RASTER_BLOCK_SIZE - 1);
+			float reach_y = setup->reciprocal_w.step_y * (RASTER_BLOCK_SIZE - 1);
+			float block_max_reciprocal_w = corner_reciprocal_w + (reach_x > 0 ? reach_x : 0) + (reach_y > 0 ? reach_y : 0);
+			float block_min_reciprocal_w = corner_reciprocal_w + (reach_x < 0 ? reach_x : 0) + (reach_y < 0 ? reach_y : 0);
+
+			// Skip the block when even the nearest point of the triangle is behind everything already drawn there
+			float* block_farthest_depth = &hiz_buffer[(block_y / RASTER_BLOCK_SIZE) * hiz_width + (block_x / RASTER_BLOCK_SIZE)];
+			float nearest_depth = 1.0 - block_max_reciprocal_w;
+			if (nearest_depth < triangle_nearest_depth) {
+				nearest_depth = triangle_nearest_depth;
+			}
+			if (is_depth_tested && nearest_depth - HIZ_DEPTH_EPSILON >= *block_farthest_depth) {
+				num_blocks_rejected++;
+				num_pixel_tests_avoided += count * (end_y - block_y + 1);
+				continue;
+			}
+			num_blocks_drawn++;
+			resolve_cleared_block(block_x, block_y, cleared_buffers);
+
+			// Fully covered blocks are filled without any per-pixel edge tests
+			if (block_inside) {
+				for (int y = block_y; y <= end_y; y++) {
+					num_pixels_written += shade_span(setup, block_x, y, count, (1u << count) - 1);
+				}
+
+				// Every pixel of the block is now at most as far as the farthest point of the triangle in it
+				float farthest_depth = 1.0 - block_min_reciprocal_w + HIZ_DEPTH_EPSILON;
+				if (is_depth_tested && farthest_depth < *block_farthest_depth) {
+					*block_farthest_depth = farthest_depth;
+				}
+				continue;
 			}
 
-			// Draw each pixel with the color code derived from the texture
-			for (int x = x_start; x < x_end; x++) {
-				draw_triangle_texel(x, y, texture, point_a, point_b, point_c, a_uv, b_uv, c_uv);
+			// Partially covered blocks step the edge functions one pixel at a time to build a coverage mask
+			int64_t row_w0 = edge_at(edges[0], block_x, block_y);
+			int64_t row_w1 = edge_at(edges[1], block_x, block_y);
+			int64_t row_w2 = edge_at(edges[2], block_x, block_y);
+
+			for (int y = block_y; y <= end_y; y++) {
+				int64_t w0 = row_w0;
+				int64_t w1 = row_w1;
+				int64_t w2 = row_w2;
+				unsigned int mask = 0;
+				for (int i = 0; i < count; i++) {
+					if ((w0 | w1 | w2) >= 0) {
+						mask |= 1u << i;
+					}
+					w0 += edges[0].step_x;
+					w1 += edges[1].step_x;
+					w2 += edges[2].step_x;
+				}
+				if (mask != 0) {
+					num_pixels_written += shade_span(setup, block_x, y, count, mask);
+				}
+				row_w0 += edges[0].step_y;
+				row_w1 += edges[1].step_y;
+				row_w2 += edges[2].step_y;
 			}
 		}
 	}
+
+	// Counters are added once per triangle since tile workers share them
+	add_stat(STAT_TRIANGLES_RASTERIZED, 1);
+	add_stat(STAT_HIZ_BLOCKS_REJECTED, num_blocks_rejected);
+	add_stat(STAT_HIZ_PIXEL_TESTS_AVOIDED, num_pixel_tests_avoided);
+	if (num_blocks_drawn == 0 && num_blocks_rejected > 0) {
+		add_stat(STAT_HIZ_TRIANGLES_REJECTED, 1);
+	}
+	return num_pixels_written;
+}
+
+static screen_rect_t full_screen_rect(void) {
+	screen_rect_t rect = { 0, 0, get_window_width() - 1, get_window_height() - 1 };
+	return rect;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Draw a filled triangle with the edge function method
+///////////////////////////////////////////////////////////////////////////////
+void draw_filled_triangle(
+	float x0, float y0, float z0, float w0,
+	float x1, float y1, float z1, float w1,
+	float x2, float y2, float z2, float w2,
+	uint32_t color
+) {
+	triangle_t triangle = {
+		.points = {
+			{ x0, y0, z0, w0 },
+			{ x1, y1, z1, w1 },
+			{ x2, y2, z2, w2 }
+		},
+		.color = color
+	};
+
+	draw_filled_triangle_in_rect(&triangle, full_screen_rect());
+}
+
+// Only the pixels inside rect are drawn, which lets tile workers draw the same triangle side by side
+void draw_filled_triangle_in_rect(triangle_t* triangle, screen_rect_t rect) {
+	vec4_t vertices[3] = {
+		triangle->points[0],
+		triangle->points[1],
+		triangle->points[2]
+	};
+	triangle_setup_t setup = {
+		.depth_test = is_depth_test_enabled() ? DEPTH_TEST_LESS : DEPTH_TEST_NONE,
+		.color = triangle->color
+	};
+
+	add_stat(STAT_PIXELS_SHADED, rasterize_triangle(vertices, NULL, &setup, SPAN_SHADING_FLAT, rect));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Depth pre-pass of a triangle
+///////////////////////////////////////////////////////////////////////////////
+// Only the z-buffer (and the hierarchical z-buffer) is written. Once every
+// triangle went through the pre-pass, the z-buffer holds the nearest depth of
+// each pixel, and the textured pass only fetches texels for the pixels whose
+// depth is exactly that value, so each pixel is shaded once at most.
+///////////////////////////////////////////////////////////////////////////////
+void draw_triangle_depth_in_rect(triangle_t* triangle, screen_rect_t rect) {
+	vec4_t vertices[3] = {
+		triangle->points[0],
+		triangle->points[1],
+		triangle->points[2]
+	};
+	triangle_setup_t setup = {
+		.depth_test = DEPTH_TEST_LESS
+	};
+
+	add_stat(STAT_DEPTH_PREPASS_PIXELS, rasterize_triangle(vertices, NULL, &setup, SPAN_SHADING_DEPTH, rect));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Draw a textured triangle with the edge function method
+///////////////////////////////////////////////////////////////////////////////
+void draw_textured_triangle(
+	float x0, float y0, float z0, float w0, float u0, float v0,
+	float x1, float y1, float z1, float w1, float u1, float v1,
+	float x2, float y2, float z2, float w2, float u2, float v2,
+	upng_t* texture
+) {
+	triangle_t triangle = {
+		.points = {
+			{ x0, y0, z0, w0 },
+			{ x1, y1, z1, w1 },
+			{ x2, y2, z2, w2 }
+		},
+		.texcoords = {
+			{ u0, v0 },
+			{ u1, v1 },
+			{ u2, v2 }
+		},
+		.texture = texture
+	};
+
+	draw_textured_triangle_in_rect(&triangle, full_screen_rect());
+}
+
+void draw_textured_triangle_in_rect(triangle_t* triangle, screen_rect_t rect) {
+	vec4_t vertices[3] = {
+		triangle->points[0],
+		triangle->points[1],
+		triangle->points[2]
+	};
+
+	// Flip the v component to account for inverted uv-coordinates (top-left start instead of bottom-left)
+	tex2_t texcoords[3] = {
+		{ triangle->texcoords[0].u, 1.0 - triangle->texcoords[0].v },
+		{ triangle->texcoords[1].u, 1.0 - triangle->texcoords[1].v },
+		{ triangle->texcoords[2].u, 1.0 - triangle->texcoords[2].v }
+	};
+
+	// Get the mesh texture width, height, and buffer of colors once for the whole triangle
+	triangle_setup_t setup = {
+		.depth_test = !is_depth_test_enabled() ? DEPTH_TEST_NONE : (should_render_depth_prepass() ? DEPTH_TEST_EQUAL : DEPTH_TEST_LESS),
+		.texture_buffer = (uint32_t*)upng_get_buffer(triangle->texture),
+		.texture_width = upng_get_width(triangle->texture),
+		.texture_height = upng_get_height(triangle->texture)
+	};
+
+	add_stat(STAT_PIXELS_SHADED, rasterize_triangle(vertices, texcoords, &setup, SPAN_SHADING_TEXTURED, rect));
 }
\ No newline at end of file
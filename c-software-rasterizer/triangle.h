@@ -24,22 +24,83 @@ typedef struct {
 	upng_t* texture;
 } triangle_t;
 
+// Growable array of triangles in submission order, the triangles to render of one geometry chunk
+typedef struct {
+	triangle_t* triangles;
+	int count;
+	int capacity;
+} triangle_queue_t;
+
+// Attribute that varies linearly across the screen, stepped per pixel by the rasterizer
+typedef struct {
+	float origin;	// Value of the attribute at the anchor vertex
+	float step_x;	// Increment when moving one pixel to the right
+	float step_y;	// Increment when moving one pixel down
+} attribute_plane_t;
+
+// Depth comparison done by the span shaders before a pixel is written
+enum depth_test {
+	DEPTH_TEST_LESS,	// Keep the pixel when it is nearer than the stored depth
+	DEPTH_TEST_EQUAL,	// Keep the pixel when it is exactly the stored depth (after a depth pre-pass)
+	DEPTH_TEST_NONE,	// Keep every covered pixel without reading or writing the z-buffer
+	NUM_DEPTH_TESTS
+};
+
+// How the texture coordinates of a triangle are interpolated across its spans
+enum texture_interpolation {
+	TEXTURE_INTERPOLATION_PERSPECTIVE,	// Exact perspective divide at every pixel
+	TEXTURE_INTERPOLATION_SUBDIVIDED,	// Exact divide at both ends of a span, affine in between
+	TEXTURE_INTERPOLATION_AFFINE,		// No divide, u and v are planes in screen space
+	NUM_TEXTURE_INTERPOLATIONS
+};
+
+// Values computed once per triangle and shared by every span of that triangle
+typedef struct {
+	int anchor_x;
+	int anchor_y;
+	int depth_test;
+	int texture_interpolation;
+	attribute_plane_t reciprocal_w;
+	attribute_plane_t u_over_w;	// Holds u itself with affine interpolation
+	attribute_plane_t v_over_w;	// Holds v itself with affine interpolation
+	float depth_offset;			// Integer depth formats store depth_offset + depth_scale * 1/w, clamped to [1, depth_max] and truncated
+	float depth_scale;
+	float depth_max;
+	uint32_t color;
+	uint32_t* texture_buffer;
+	int texture_width;
+	int texture_height;
+} triangle_setup_t;
+
+// Screen rectangle with inclusive bounds that rasterization is limited to
+typedef struct {
+	int min_x;
+	int min_y;
+	int max_x;
+	int max_y;
+} screen_rect_t;
+
 vec3_t get_triangle_normal(vec4_t vertices[3]);
+float plane_at(attribute_plane_t plane, float dx, float dy);
 
 void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color);
 
 void draw_filled_triangle(
-	int x0, int y0, float z0, float w0,
-	int x1, int y1, float z1, float w1,
-	int x2, int y2, float z2, float w2,
+	float x0, float y0, float z0, float w0,
+	float x1, float y1, float z1, float w1,
+	float x2, float y2, float z2, float w2,
 	uint32_t color
 );
 
 void draw_textured_triangle(
-	int x0, int y0, float z0, float w0, float u0, float v0,
-	int x1, int y1, float z1, float w1, float u1, float v1,
-	int x2, int y2, float z2, float w2, float u2, float v2,
+	float x0, float y0, float z0, float w0, float u0, float v0,
+	float x1, float y1, float z1, float w1, float u1, float v1,
+	float x2, float y2, float z2, float w2, float u2, float v2,
 	upng_t* texture
 );
 
+void draw_filled_triangle_in_rect(triangle_t* triangle, screen_rect_t rect);
+void draw_triangle_depth_in_rect(triangle_t* triangle, screen_rect_t rect);
+void draw_textured_triangle_in_rect(triangle_t* triangle, screen_rect_t rect);
+
 #endif
\ No newline at end of file